@@ -0,0 +1,153 @@
+#include "Scheduler.h"
+
+#include <stdio.h>
+#include <time.h>
+
+
+static uint64_t now()
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+static const char* const class_names[Scheduler::CLASS_MAX] =
+{
+	"interactive",
+	"bulk",
+};
+
+
+Scheduler::Scheduler(unsigned workers, const unsigned (&weights)[CLASS_MAX])
+	: stop_(false)
+{
+	for (int c = 0; c < CLASS_MAX; ++c)
+		queues_[c].weight = queues_[c].credit = weights[c];
+
+	for (unsigned i = 0; i < workers; ++i)
+		workers_.emplace_back(&Scheduler::work, this);
+}
+
+Scheduler::~Scheduler()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		stop_ = true;
+	}
+	cv_.notify_all();
+
+	for (std::thread& worker : workers_)
+		worker.join();
+}
+
+void Scheduler::run(Class c, void (*fn)(void*), void* arg)
+{
+	Job job;
+	job.fn = fn;
+	job.arg = arg;
+	job.done = false;
+	job.next = nullptr;
+
+	std::unique_lock<std::mutex> lock(mutex_);
+
+	job.enqueued = now();
+
+	Queue& queue = queues_[c];
+	if (queue.tail)
+		queue.tail->next = &job;
+	else
+		queue.head = &job;
+	queue.tail = &job;
+	++queue.depth;
+
+	cv_.notify_one();
+
+	job.cv.wait(lock, [&job] { return job.done; });
+}
+
+Scheduler::Job* Scheduler::next()
+{
+	Queue* chosen = nullptr;
+
+	// weighted round robin over the classes that have jobs,
+	// the credits are refilled when all of them have spent theirs
+	for (int pass = 0; pass < 2 && ! chosen; ++pass)
+	{
+		for (Queue& queue : queues_)
+		{
+			if (queue.head && queue.credit)
+			{
+				--queue.credit;
+				chosen = &queue;
+				break;
+			}
+		}
+
+		if ( ! chosen)
+		{
+			for (Queue& queue : queues_)
+				queue.credit = queue.weight;
+		}
+	}
+
+	// only the classes of weight 0 have jobs
+	for (int c = 0; c < CLASS_MAX && ! chosen; ++c)
+	{
+		if (queues_[c].head)
+			chosen = &queues_[c];
+	}
+
+	if ( ! chosen)
+		return nullptr;
+
+	Job* job = chosen->head;
+	chosen->head = job->next;
+	if ( ! chosen->head)
+		chosen->tail = nullptr;
+	--chosen->depth;
+
+	const uint64_t wait = now() - job->enqueued;
+	++chosen->jobs;
+	chosen->wait_total += wait;
+	if (wait > chosen->wait_max)
+		chosen->wait_max = wait;
+
+	return job;
+}
+
+void Scheduler::work()
+{
+	std::unique_lock<std::mutex> lock(mutex_);
+	for (;;)
+	{
+		Job* job = nullptr;
+		cv_.wait(lock, [this, &job] { return stop_ || (job = next()) != nullptr; });
+		if ( ! job)
+			break;
+
+		lock.unlock();
+		job->fn(job->arg);
+		lock.lock();
+
+		job->done = true;
+		job->cv.notify_one();
+	}
+}
+
+std::string Scheduler::report()const
+{
+	std::string report = "class        weight  depth  jobs        wait_avg_us  wait_max_us\n";
+
+	std::lock_guard<std::mutex> lock(mutex_);
+	for (int c = 0; c < CLASS_MAX; ++c)
+	{
+		const Queue& queue = queues_[c];
+		char line[128];
+		snprintf(line, sizeof(line), "%-12s %-7u %-6zu %-11llu %-12.1f %.1f\n",
+			class_names[c], queue.weight, queue.depth, static_cast<unsigned long long>(queue.jobs),
+			queue.jobs ? queue.wait_total / 1000.0 / queue.jobs : 0.0, queue.wait_max / 1000.0);
+		report += line;
+	}
+
+	return report;
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <stdint.h>
+
+
+// Runs the requests on a bounded pool of worker threads, taking them from one queue per class of requests.
+// The classes share the workers in proportion to their weights: with weights 8 and 1,
+// 8 interactive requests are run for each bulk one while both are waiting.
+// A class with weight 0 only gets the workers when no other class is waiting (strict priority).
+class Scheduler
+{
+public:
+	enum Class
+	{
+		CLASS_INTERACTIVE,
+		CLASS_BULK,
+
+		CLASS_MAX
+	};
+
+	Scheduler(unsigned workers, const unsigned (&weights)[CLASS_MAX]);
+	~Scheduler();
+
+	Scheduler(const Scheduler&) = delete;
+	Scheduler& operator=(const Scheduler&) = delete;
+
+	// Runs 'f' on a worker, the caller is blocked until it's done
+	template<typename F>
+	void run(Class c, F& f)
+	{
+		run(c, [](void* arg) { (*static_cast<F*>(arg))(); }, &f);
+	}
+
+	// Queue depth and wait time of every class, one line per class
+	std::string report()const;
+
+private:
+	// Lives on the stack of the caller of run()
+	struct Job
+	{
+		void (*fn)(void*);
+		void* arg;
+		uint64_t enqueued;
+		bool done;
+		std::condition_variable cv;
+		Job* next;
+	};
+
+	struct Queue
+	{
+		Job* head = nullptr;
+		Job* tail = nullptr;
+		size_t depth = 0;
+		unsigned weight = 0;
+		unsigned credit = 0;
+
+		uint64_t jobs = 0;
+		uint64_t wait_total = 0; // ns
+		uint64_t wait_max = 0;   // ns
+	};
+
+	void run(Class c, void (*fn)(void*), void* arg);
+	Job* next();
+	void work();
+
+	mutable std::mutex mutex_;
+	std::condition_variable cv_;
+	bool stop_;
+	Queue queues_[CLASS_MAX];
+	std::vector<std::thread> workers_;
+};
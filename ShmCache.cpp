@@ -0,0 +1,282 @@
+#include "ShmCache.h"
+#include "Logger.h"
+
+#include <atomic>
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+// "MBTSHM" and the layout version
+static const uint64_t MAGIC = 0x4d425453484d0002ull;
+
+static const size_t ALIGN = 64;
+static const size_t MIN_SHARD_SIZE = 1 << 20;
+static const uint32_t MAX_SHARDS = 16;
+static const size_t AVERAGE_TILE_SIZE = 16 * 1024;
+static const uint32_t PROBES = 8;
+
+static size_t align(size_t size)
+{
+	return (size + ALIGN - 1) / ALIGN * ALIGN;
+}
+
+struct ShmCache::Header
+{
+	// set by the creator once the shards are initialized
+	std::atomic<uint64_t> magic;
+	uint32_t shard_count;
+	uint32_t entry_count; // per shard
+	uint64_t shard_size;
+	uint64_t data_size;   // per shard
+};
+
+// A shard is followed by its entries, then by its data ring buffer
+struct ShmCache::Shard
+{
+	pthread_mutex_t mutex;
+	// position in the ring buffer where the next tile is written, it only grows:
+	// the data of an entry is valid as long as it is less than data_size behind
+	uint64_t head;
+};
+
+struct ShmCache::Entry
+{
+	uint64_t data_hash; // of the tile as it is stored
+	int32_t zoom_level;
+	int32_t tile_column;
+	int32_t tile_row;
+	uint32_t size; // 0 - free
+	uint64_t pos;
+};
+
+static uint64_t hash(uint64_t data_hash, int zoom_level, int tile_column, int tile_row)
+{
+	// splitmix64 finalizer
+	uint64_t h = data_hash ^ ((uint64_t(zoom_level) << 58) | (uint64_t(tile_column) << 29) | uint64_t(tile_row));
+	h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ull;
+	h = (h ^ (h >> 27)) * 0x94d049bb133111ebull;
+	return h ^ (h >> 31);
+}
+
+
+ShmCache::ShmCache(const std::string& name, size_t size)
+	: header_(nullptr)
+	, size_(0)
+{
+	bool created = true;
+	int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd < 0 && errno == EEXIST)
+	{
+		created = false;
+		fd = shm_open(name.c_str(), O_RDWR, 0);
+	}
+	if (fd < 0)
+	{
+		LOG_ERROR("shm_open failed for %s: %s", name.c_str(), strerror(errno));
+		return;
+	}
+
+	if (created)
+	{
+		if (size < align(sizeof(Header)) + MIN_SHARD_SIZE || ftruncate(fd, size) != 0)
+		{
+			LOG_ERROR("can't create shared memory %s of %zu bytes", name.c_str(), size);
+			close(fd);
+			shm_unlink(name.c_str());
+			return;
+		}
+	}
+	else
+	{
+		// the creator may not have sized it yet
+		struct stat st;
+		for (int i = 0; fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) < sizeof(Header) && i < 100; ++i)
+			usleep(10000);
+		size = st.st_size;
+	}
+
+	void* memory = size < sizeof(Header) ? MAP_FAILED :
+		mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (memory == MAP_FAILED)
+	{
+		LOG_ERROR("can't map shared memory %s", name.c_str());
+		return;
+	}
+
+	Header* header = static_cast<Header*>(memory);
+
+	if (created)
+	{
+		header->shard_count = std::min<size_t>(MAX_SHARDS, (size - align(sizeof(Header))) / MIN_SHARD_SIZE);
+		header->shard_size = (size - align(sizeof(Header))) / header->shard_count / ALIGN * ALIGN;
+		header->entry_count = header->shard_size / AVERAGE_TILE_SIZE;
+		header->data_size = header->shard_size - align(sizeof(Shard)) - align(header->entry_count * sizeof(Entry));
+
+		pthread_mutexattr_t attr;
+		pthread_mutexattr_init(&attr);
+		pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+		pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+
+		header_ = header;
+		for (uint32_t i = 0; i < header->shard_count; ++i)
+		{
+			Shard* s = shard(i);
+			pthread_mutex_init(&s->mutex, &attr);
+			s->head = 0;
+			memset(entries(s), 0, header->entry_count * sizeof(Entry));
+		}
+		header_ = nullptr;
+
+		pthread_mutexattr_destroy(&attr);
+
+		header->magic.store(MAGIC, std::memory_order_release);
+	}
+	else
+	{
+		for (int i = 0; header->magic.load(std::memory_order_acquire) != MAGIC && i < 100; ++i)
+			usleep(10000);
+	}
+
+	if (header->magic.load(std::memory_order_acquire) != MAGIC)
+	{
+		LOG_ERROR("shared memory %s is not a tile cache or is of another version, remove it", name.c_str());
+		munmap(memory, size);
+		return;
+	}
+
+	header_ = header;
+	size_ = size;
+}
+
+ShmCache::~ShmCache()
+{
+	if (header_)
+		munmap(header_, size_);
+}
+
+ShmCache::Shard* ShmCache::shard(uint64_t hash)const
+{
+	char* shards = reinterpret_cast<char*>(header_) + align(sizeof(Header));
+	return reinterpret_cast<Shard*>(shards + hash % header_->shard_count * header_->shard_size);
+}
+
+ShmCache::Entry* ShmCache::entries(Shard* shard)const
+{
+	return reinterpret_cast<Entry*>(reinterpret_cast<char*>(shard) + align(sizeof(Shard)));
+}
+
+char* ShmCache::data(Shard* shard)const
+{
+	return reinterpret_cast<char*>(entries(shard)) + align(header_->entry_count * sizeof(Entry));
+}
+
+void ShmCache::lock(Shard* shard)
+{
+	int rc = pthread_mutex_lock(&shard->mutex);
+	if (rc == EOWNERDEAD)
+	{
+		// the owner died in the middle of an update, the shard can't be trusted
+		LOG_WARNING("ShmCache: the owner of a shard died, clearing it");
+		shard->head = 0;
+		memset(entries(shard), 0, header_->entry_count * sizeof(Entry));
+		pthread_mutex_consistent(&shard->mutex);
+	}
+}
+
+void ShmCache::unlock(Shard* shard)
+{
+	pthread_mutex_unlock(&shard->mutex);
+}
+
+bool ShmCache::find(uint64_t data_hash, int zoom_level, int tile_column, int tile_row, std::string& tile)
+{
+	if ( ! header_)
+		return false;
+
+	const uint64_t h = hash(data_hash, zoom_level, tile_column, tile_row);
+	Shard* s = shard(h);
+	const Entry* entries = this->entries(s);
+	const char* data = this->data(s);
+	const uint32_t first = (h >> 32) % header_->entry_count;
+
+	bool found = false;
+
+	lock(s);
+	for (uint32_t i = 0; i < PROBES; ++i)
+	{
+		const Entry& entry = entries[(first + i) % header_->entry_count];
+		if (entry.size && entry.data_hash == data_hash && entry.zoom_level == zoom_level &&
+			entry.tile_column == tile_column && entry.tile_row == tile_row)
+		{
+			if (s->head - entry.pos <= header_->data_size)
+			{
+				tile.assign(data + entry.pos % header_->data_size, entry.size);
+				found = true;
+			}
+			break;
+		}
+	}
+	unlock(s);
+
+	return found;
+}
+
+void ShmCache::insert(uint64_t data_hash, int zoom_level, int tile_column, int tile_row, const std::string& tile)
+{
+	// a huge tile would flush a large part of the shard
+	if ( ! header_ || tile.empty() || tile.size() > header_->data_size / 4)
+		return;
+
+	const uint64_t h = hash(data_hash, zoom_level, tile_column, tile_row);
+	Shard* s = shard(h);
+	Entry* entries = this->entries(s);
+	char* data = this->data(s);
+	const uint32_t first = (h >> 32) % header_->entry_count;
+
+	lock(s);
+
+	// the same tile, else a free entry, else the oldest one
+	Entry* slot = nullptr;
+	for (uint32_t i = 0; i < PROBES; ++i)
+	{
+		Entry* entry = &entries[(first + i) % header_->entry_count];
+		if (entry->size && entry->data_hash == data_hash && entry->zoom_level == zoom_level &&
+			entry->tile_column == tile_column && entry->tile_row == tile_row)
+		{
+			slot = entry;
+			break;
+		}
+
+		// outdated entries are the oldest ones
+		if ( ! slot || (slot->size && ( ! entry->size || entry->pos < slot->pos)))
+			slot = entry;
+	}
+
+	// the data of an entry is never split at the end of the ring buffer
+	uint64_t offset = s->head % header_->data_size;
+	if (offset + tile.size() > header_->data_size)
+	{
+		s->head += header_->data_size - offset;
+		offset = 0;
+	}
+
+	memcpy(data + offset, tile.data(), tile.size());
+
+	slot->data_hash = data_hash;
+	slot->zoom_level = zoom_level;
+	slot->tile_column = tile_column;
+	slot->tile_row = tile_row;
+	slot->size = tile.size();
+	slot->pos = s->head;
+
+	s->head += tile.size();
+
+	unlock(s);
+}
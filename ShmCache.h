@@ -0,0 +1,52 @@
+#pragma once
+
+#include <string>
+#include <stddef.h>
+#include <stdint.h>
+
+
+// Cache of decoded tiles in POSIX shared memory.
+// All the processes attached to the same shared memory object share the cache,
+// so a tile decoded by one mount is served from memory to the others,
+// and the cache outlives the processes until the object is removed (rm /dev/shm/<name>).
+//
+// The memory is split into shards, each with its own process-shared mutex.
+// A shard keeps the tiles in a ring buffer: new tiles overwrite the oldest ones,
+// so the memory budget is fixed when the object is created.
+class ShmCache
+{
+public:
+	// Attaches to the shared memory object 'name', creating it with 'size' bytes if it doesn't exist.
+	// An existing object keeps its own size.
+	ShmCache(const std::string& name, size_t size);
+	~ShmCache();
+
+	ShmCache(const ShmCache&) = delete;
+	ShmCache& operator=(const ShmCache&) = delete;
+
+	bool attached()const
+	{
+		return header_ != nullptr;
+	}
+
+	// The tiles are keyed by their coordinates and by the hash of the tile as it is stored,
+	// so an unchanged tile is still found after the MBTiles file is republished.
+	// Copies the tile to 'tile', returns false if it isn't cached
+	bool find(uint64_t data_hash, int zoom_level, int tile_column, int tile_row, std::string& tile);
+
+	void insert(uint64_t data_hash, int zoom_level, int tile_column, int tile_row, const std::string& tile);
+
+private:
+	struct Header;
+	struct Shard;
+	struct Entry;
+
+	Shard* shard(uint64_t hash)const;
+	Entry* entries(Shard* shard)const;
+	char* data(Shard* shard)const;
+	void lock(Shard* shard);
+	void unlock(Shard* shard);
+
+	Header* header_;
+	size_t size_;
+};
@@ -0,0 +1,167 @@
+#include "Tracer.h"
+
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+
+static const size_t RING_SIZE = 8192;
+
+namespace
+{
+	struct Event
+	{
+		const char* name;
+		uint64_t begin;
+		uint64_t end;
+		long tid;
+		unsigned depth;
+	};
+
+	// Events of one thread, the oldest ones are overwritten.
+	// The mutex is only contended while dumping.
+	struct Ring
+	{
+		std::mutex mutex;
+		bool owned = false;
+		uint64_t count = 0;
+		Event events[RING_SIZE];
+	};
+
+	// All the rings ever created; the ring of a finished thread is reused by a new one,
+	// keeping the events of the finished thread until they are overwritten.
+	std::mutex rings_mutex;
+	std::vector<std::unique_ptr<Ring>> rings;
+
+	struct ThreadState
+	{
+		Ring* ring = nullptr;
+		long tid = 0;
+		unsigned depth = 0;
+		bool sampled = false;
+		unsigned requests = 0;
+
+		~ThreadState()
+		{
+			if (ring)
+			{
+				std::lock_guard<std::mutex> lock(rings_mutex);
+				ring->owned = false;
+			}
+		}
+
+		Ring* getRing()
+		{
+			if ( ! ring)
+			{
+				tid = syscall(SYS_gettid);
+
+				std::lock_guard<std::mutex> lock(rings_mutex);
+				for (const auto& r : rings)
+				{
+					if ( ! r->owned)
+					{
+						ring = r.get();
+						break;
+					}
+				}
+				if ( ! ring)
+				{
+					rings.emplace_back(new Ring);
+					ring = rings.back().get();
+				}
+				ring->owned = true;
+			}
+			return ring;
+		}
+	};
+
+	thread_local ThreadState thread_state;
+
+	uint64_t now()
+	{
+		timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+	}
+}
+
+std::atomic<unsigned> Tracer::sample_rate_{0};
+
+void TraceSpan::begin(const char* name, unsigned sample_rate)
+{
+	ThreadState& state = thread_state;
+
+	// the outermost span decides whether the whole request is recorded
+	if (state.depth == 0)
+		state.sampled = state.requests++ % sample_rate == 0;
+
+	++state.depth;
+	active_ = true;
+
+	if (state.sampled)
+	{
+		name_ = name;
+		begin_ = now();
+	}
+}
+
+void TraceSpan::end()
+{
+	ThreadState& state = thread_state;
+	--state.depth;
+	if (name_)
+		Tracer::record(name_, begin_, now(), state.depth);
+}
+
+void Tracer::record(const char* name, uint64_t begin, uint64_t end, unsigned depth)
+{
+	ThreadState& state = thread_state;
+	Ring* ring = state.getRing();
+
+	std::lock_guard<std::mutex> lock(ring->mutex);
+	ring->events[ring->count++ % RING_SIZE] = Event{name, begin, end, state.tid, depth};
+}
+
+bool Tracer::dump(const std::string& filename)
+{
+	FILE* file = fopen(filename.c_str(), "w");
+	if ( ! file)
+		return false;
+
+	// the events are copied out under the locks and written without them,
+	// so that the traced threads are not blocked by the file I/O
+	std::vector<Event> events;
+	{
+		std::lock_guard<std::mutex> lock(rings_mutex);
+		for (const auto& ring : rings)
+		{
+			std::lock_guard<std::mutex> ring_lock(ring->mutex);
+
+			const uint64_t begin = ring->count > RING_SIZE ? ring->count - RING_SIZE : 0;
+			for (uint64_t i = begin; i < ring->count; ++i)
+				events.push_back(ring->events[i % RING_SIZE]);
+		}
+	}
+
+	const int pid = getpid();
+	bool first = true;
+
+	fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+
+	for (const Event& event : events)
+	{
+		fprintf(file, "%s{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%i,\"tid\":%li,\"args\":{\"depth\":%u}}",
+			first ? "" : ",\n", event.name, event.begin / 1000.0, (event.end - event.begin) / 1000.0,
+			pid, event.tid, event.depth);
+		first = false;
+	}
+
+	fprintf(file, "\n]}\n");
+
+	return fclose(file) == 0;
+}
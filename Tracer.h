@@ -0,0 +1,73 @@
+#pragma once
+
+#include <string>
+#include <atomic>
+#include <stdint.h>
+
+
+// Records the spans of the requests into per-thread ring buffers
+// and dumps them in the Chrome trace event format (chrome://tracing, https://ui.perfetto.dev).
+//
+// Only one request out of 'sample_rate' is recorded on every thread, with all its nested spans,
+// so that tracing can stay enabled in production.
+class Tracer
+{
+public:
+	// 0 - disabled (default)
+	static void setSampleRate(unsigned sample_rate)
+	{
+		sample_rate_.store(sample_rate, std::memory_order_relaxed);
+	}
+
+	static unsigned sampleRate()
+	{
+		return sample_rate_.load(std::memory_order_relaxed);
+	}
+
+	// Writes the spans recorded so far, returns false if the file can't be written
+	static bool dump(const std::string& filename);
+
+private:
+	friend class TraceSpan;
+
+	static void record(const char* name, uint64_t begin, uint64_t end, unsigned depth);
+
+	static std::atomic<unsigned> sample_rate_;
+};
+
+// Span of a request or of one of its phases, from construction to destruction
+class TraceSpan
+{
+public:
+	explicit TraceSpan(const char* name)
+		: active_(false)
+		, name_(nullptr)
+	{
+		const unsigned sample_rate = Tracer::sampleRate();
+		if (sample_rate)
+			begin(name, sample_rate);
+	}
+
+	~TraceSpan()
+	{
+		if (active_)
+			end();
+	}
+
+	TraceSpan(const TraceSpan&) = delete;
+	TraceSpan& operator=(const TraceSpan&) = delete;
+
+private:
+	void begin(const char* name, unsigned sample_rate);
+	void end();
+
+	bool active_;
+	// nullptr if the request isn't sampled
+	const char* name_;
+	uint64_t begin_;
+};
+
+#define TRACE_SPAN_CONCAT_(a, b) a##b
+#define TRACE_SPAN_NAME_(line) TRACE_SPAN_CONCAT_(trace_span_, line)
+// Traces the rest of the enclosing block, 'name' must be a string literal
+#define TRACE_SPAN(name) TraceSpan TRACE_SPAN_NAME_(__LINE__)(name)
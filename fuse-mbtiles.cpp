@@ -3,8 +3,14 @@
 #include <sqlite3.h>
 #include <zlib.h>
 #include <string.h>
+#include <limits.h>
 #include <iostream>
 #include <sstream>
+#include <fstream>
+#include <chrono>
+#include <condition_variable>
+#include <unordered_set>
+#include <sys/stat.h>
 #include <assert.h>
 #if __cplusplus >= 201703L
 #include <optional>
@@ -14,30 +20,159 @@ using std::optional;
 using boost::optional;
 #endif
 #include "Logger.h"
-#ifdef USE_LOGGER
+#include "ShmCache.h"
+#include "Tracer.h"
+#include "Scheduler.h"
 #include <unordered_map>
-#endif //USE_LOGGER
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+#include <libgen.h>
+#include <sys/inotify.h>
 
 
 static std::string mbtiles_filename;
 
-static std::string ext;
-
 // Whether or not to automatically compute the valid levels of the MBTiles file.
 // By default this is false and will not scan the table to determine the min/max.
 // This can take time when first loading the file so if you know the levels
 // of your file up front you can set this to false and just use the min_level and
 // max_level settings of the tile source.
 static bool compute_levels = false;
-static optional<int> minLevel;
-static optional<int> maxLevel;
+
+// Whether or not to watch the MBTiles file with inotify and reload it when it is republished.
+// A reload can always be requested with SIGUSR1.
+static bool watch = false;
+
+// Whether or not to stream pbf tiles with direct_io instead of inflating the whole tile on every read.
+// The reported file size is then the size of the stored (compressed) tile.
+static bool streaming = false;
+
+// Scheduling of the requests, disabled if sched_workers is 0.
+// Requests of the bulk_uids users, requests for zoom levels from bulk_zoom and directory listings
+// are run as bulk requests, the others as interactive ones.
+static unsigned sched_workers = 0;
+static unsigned sched_weights[Scheduler::CLASS_MAX] = {8, 1};
+static std::vector<uid_t> bulk_uids;
+static int bulk_zoom = 0; // 0 - none
+static std::unique_ptr<Scheduler> scheduler;
+
+// Virtual file with the scheduler statistics, not listed in the root directory
+static const char* const SCHEDULER_STATS_PATH = "/.scheduler";
+
+// Where the spans of the requests are dumped on SIGUSR2 and at exit, tracing is disabled if empty
+static std::string trace_file;
+
+// Optional cache of decoded pbf tiles in shared memory, shared with the other instances on the host
+static std::unique_ptr<ShmCache> shm_cache;
+
+// Attributes of the tiles, kept to avoid looking them up again.
+// The sizes of the tile files are filled in bulk by readdir, so that listing a directory with attributes
+// (ls -l, find, rsync) doesn't look up, and for pbf decompress, every tile one by one.
+template<typename T>
+class TileCache
+{
+public:
+	bool find(int zoom_level, int tile_column, int tile_row, T& value)const
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		auto it = values_.find(key(zoom_level, tile_column, tile_row));
+		if (it == values_.end())
+			return false;
+		value = it->second;
+		return true;
+	}
+
+	void insert(int zoom_level, int tile_column, int tile_row, T value)
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		// keep the memory bounded: the cache is refilled by the next listing anyway
+		if (values_.size() >= MAX_VALUES)
+			values_.clear();
+		values_[key(zoom_level, tile_column, tile_row)] = value;
+	}
+
+private:
+	static const size_t MAX_VALUES = 1 << 20;
+
+	static uint64_t key(int zoom_level, int tile_column, int tile_row)
+	{
+		return (uint64_t(zoom_level) << 58) | (uint64_t(tile_column) << 29) | uint64_t(tile_row);
+	}
+
+	mutable std::mutex mutex_;
+	std::unordered_map<uint64_t, T> values_;
+};
+
+// Metadata of one published version of the MBTiles file.
+// It is never modified after publication; a reload builds a new one and swaps it in,
+// while the connections opened against the old one keep using it until they are closed.
+struct Archive
+{
+	std::string filename;
+	// identifies the version of the file in the extract journal
+	uint64_t id = 0;
+	std::string ext;
+	optional<int> minLevel;
+	optional<int> maxLevel;
+	// modification time of the file, reported as the time of all the files and directories
+	struct timespec mtime = {0, 0};
+
+	// the only mutable part, it is bound to the version of the file
+	mutable TileCache<int> sizes;
+	mutable TileCache<uint64_t> hashes;
+
+	// files opened on this version and not closed yet
+	mutable std::atomic<unsigned> open_files{0};
+};
+
+// Size of a tile that had to be decompressed to get it, with the hash of the tile as it is stored.
+// Unlike the caches of the Archive it is kept across the versions of the file,
+// and is used as long as the stored tile is unchanged.
+struct DecodedSize
+{
+	uint64_t data_hash;
+	int size;
+};
+
+static TileCache<DecodedSize> decoded_sizes;
+
+static std::mutex archive_mutex;
+static std::shared_ptr<const Archive> current_archive;
+
+static std::shared_ptr<const Archive> currentArchive()
+{
+	std::lock_guard<std::mutex> lock(archive_mutex);
+	return current_archive;
+}
+
+static void setCurrentArchive(std::shared_ptr<const Archive> archive)
+{
+	std::lock_guard<std::mutex> lock(archive_mutex);
+	current_archive.swap(archive);
+}
 
 class Database
 {
 public:
 	Database()
+		: Database(currentArchive())
+	{
+	}
+
+	explicit Database(std::shared_ptr<const Archive> archive)
+		: archive_(std::move(archive))
 	{
-		int rc = sqlite3_open_v2(mbtiles_filename.c_str(), &database_,
+		TRACE_SPAN("sqlite3_open_v2");
+
+		int rc = sqlite3_open_v2(archive_->filename.c_str(), &database_,
 			SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, nullptr);
 		if (rc != SQLITE_OK)
 		{
@@ -47,6 +182,9 @@ public:
 
 	~Database()
 	{
+		for (const Statement& statement : statements_)
+			sqlite3_finalize(statement.stmt);
+
 		int rc = sqlite3_close(database_);
 		if (rc != SQLITE_OK)
 		{
@@ -54,6 +192,9 @@ public:
 		}
 	}
 
+	Database(const Database&) = delete;
+	Database& operator=(const Database&) = delete;
+
 	operator sqlite3* ()
 	{
 		return database_;
@@ -64,10 +205,148 @@ public:
 		return sqlite3_errmsg(database_);
 	}
 
+	const Archive& archive()const
+	{
+		return *archive_;
+	}
+
+	// Returns the statement for the query, prepared once per connection.
+	// The statements are looked up by the address of the query, so it must be a string literal.
+	// The caller must sqlite3_reset() the statement when done with it.
+	sqlite3_stmt* statement(const char* query)
+	{
+		for (Statement& statement : statements_)
+		{
+			if (statement.query == query)
+				return statement.stmt;
+
+			if ( ! statement.query)
+			{
+				TRACE_SPAN("prepare");
+
+				int rc = sqlite3_prepare_v2(database_, query, -1, &statement.stmt, nullptr);
+				if (rc != SQLITE_OK)
+				{
+					LOG_ERROR("sqlite3_prepare_v2 failed: %s", errmsg());
+					return nullptr;
+				}
+				statement.query = query;
+				return statement.stmt;
+			}
+		}
+
+		assert( ! "Database::statements_ is too small");
+		return nullptr;
+	}
+
 private:
+	std::shared_ptr<const Archive> archive_;
 	sqlite3 * database_;
+
+	struct Statement
+	{
+		const char* query = nullptr;
+		sqlite3_stmt* stmt = nullptr;
+	};
+	Statement statements_[4];
+};
+
+// Connection of the calling thread to the given version of the MBTiles file.
+// A thread keeps one connection per version in use: the current one,
+// and the previous ones while files opened before a reload are still open.
+// The connections to the previous versions without open files are closed here;
+// no file can be opened on them anymore, so they are never used again.
+static Database& threadDatabase(const std::shared_ptr<const Archive>& archive)
+{
+	thread_local std::vector<std::unique_ptr<Database>> databases;
+
+	Database* database = nullptr;
+	std::shared_ptr<const Archive> current;
+	for (auto it = databases.begin(); it != databases.end(); )
+	{
+		const Archive& other = (*it)->archive();
+		if (&other == archive.get())
+		{
+			database = (it++)->get();
+			continue;
+		}
+
+		if ( ! current)
+			current = currentArchive();
+		if (&other != current.get() && other.open_files == 0)
+			it = databases.erase(it);
+		else
+			++it;
+	}
+
+	if ( ! database)
+	{
+		databases.emplace_back(new Database(archive));
+		database = databases.back().get();
+	}
+
+	return *database;
+}
+
+// Connection of the calling thread to the current version of the MBTiles file
+static Database& threadDatabase()
+{
+	return threadDatabase(currentArchive());
+}
+
+// Capacity kept by the reused buffers, the bigger ones are freed after use
+// so that a few big tiles don't pin memory for the life of the process.
+static const size_t MAX_BUFFER_CAPACITY = 1 << 20;
+
+static void trimBuffer(std::string& buffer)
+{
+	buffer.clear();
+	if (buffer.capacity() > MAX_BUFFER_CAPACITY)
+		std::string().swap(buffer);
+}
+
+// Spare tile buffers.
+// The buffers of closed files are kept here with their capacity (up to MAX_BUFFER_CAPACITY),
+// so that the files opened later don't have to allocate memory again.
+class BufferPool
+{
+public:
+	BufferPool()
+	{
+		buffers_.reserve(MAX_BUFFERS);
+	}
+
+	std::string acquire()
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (buffers_.empty())
+			return std::string();
+
+		std::string buffer = std::move(buffers_.back());
+		buffers_.pop_back();
+		return buffer;
+	}
+
+	void release(std::string&& buffer)
+	{
+		if (buffer.capacity() > MAX_BUFFER_CAPACITY)
+			return;
+		buffer.clear();
+
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (buffers_.size() < MAX_BUFFERS)
+			buffers_.push_back(std::move(buffer));
+	}
+
+private:
+	static const size_t MAX_BUFFERS = 64;
+
+	std::mutex mutex_;
+	std::vector<std::string> buffers_;
 };
 
+static BufferPool buffer_pool;
+
 
 static optional<int> getMetaDataInt(Database& database, const char* key)
 {
@@ -148,281 +427,824 @@ static optional<std::string> getMetaDataString(Database& database, const char* k
 
 #define CHUNK 32768
 
-static bool decompress(std::istream& fin, std::string& target)
+// Inflate state of the calling thread.
+// It is initialized once and reset for every tile, so inflating doesn't allocate memory.
+class Inflater
 {
-	int ret;
+public:
+	Inflater()
+	{
+		strm.zalloc = Z_NULL;
+		strm.zfree = Z_NULL;
+		strm.opaque = Z_NULL;
+		strm.avail_in = 0;
+		strm.next_in = Z_NULL;
+		ok = inflateInit2(&strm, 15 + 32) == Z_OK; // autodected zlib or gzip header
+	}
+
+	~Inflater()
+	{
+		if (ok)
+			(void)inflateEnd(&strm);
+	}
+
 	z_stream strm;
-	unsigned char in[CHUNK];
-	unsigned char out[CHUNK];
+	bool ok;
+};
 
-	// allocate inflate state
-	strm.zalloc = Z_NULL;
-	strm.zfree = Z_NULL;
-	strm.opaque = Z_NULL;
-	strm.avail_in = 0;
-	strm.next_in = Z_NULL;
-	ret = inflateInit2(&strm, 15 + 32); // autodected zlib or gzip header
+// Inflates the data into the target, reusing the capacity of the target
+static bool decompress(const void* data, size_t len, std::string& target)
+{
+	TRACE_SPAN("decompress");
 
-	if (ret != Z_OK)
+	thread_local Inflater inflater;
+	if ( ! inflater.ok)
 	{
 		LOG_ERROR("decompress: failed to init");
-		return ret != 0;
+		return false;
 	}
 
-	// decompress until deflate stream ends or end of file
+	z_stream& strm = inflater.strm;
+	(void)inflateReset(&strm);
+	strm.next_in = reinterpret_cast<Bytef*>(const_cast<void*>(data));
+	strm.avail_in = len;
+
+	// inflate straight into the target, growing it when it's full:
+	// it is doubled from the size inflated so far, within its capacity when the capacity is big enough
+	size_t size = 0;
+	int ret;
 	do
 	{
-		fin.read(reinterpret_cast<char*>(in), CHUNK);
-		strm.avail_in = fin.gcount();
-		if (strm.avail_in == 0) break;
-
-		// run inflate() on input until output buffer not full
-		strm.next_in = in;
-		do
+		if (target.size() < size + CHUNK)
 		{
-			strm.avail_out = CHUNK;
-			strm.next_out = out;
-			ret = inflate(&strm, Z_NO_FLUSH);
+			size_t grow = size + std::max<size_t>(CHUNK, size);
+			if (size + CHUNK <= target.capacity())
+				grow = std::min(grow, target.capacity());
+			target.resize(grow);
+		}
 
-			switch (ret)
-			{
-			case Z_NEED_DICT:
-			case Z_DATA_ERROR:
-			case Z_MEM_ERROR:
-				(void)inflateEnd(&strm);
-				return false;
-			}
-			unsigned have = CHUNK - strm.avail_out;
-			target.append(reinterpret_cast<char*>(out), have);
-		} while (strm.avail_out == 0);
+		strm.next_out = reinterpret_cast<Bytef*>(&target[size]);
+		strm.avail_out = target.size() - size;
+		ret = inflate(&strm, Z_NO_FLUSH);
+		size = target.size() - strm.avail_out;
 
-		// done when inflate() says it's done
+		switch (ret)
+		{
+		case Z_NEED_DICT:
+		case Z_DATA_ERROR:
+		case Z_MEM_ERROR:
+		case Z_BUF_ERROR: // truncated data
+			target.clear();
+			return false;
+		}
 	} while (ret != Z_STREAM_END);
 
-	// clean up and return
-	(void)inflateEnd(&strm);
-	return ret == Z_STREAM_END ? true : false;
-}
+	// only the first gzip member would be served, while decompressedSize() gives the size of the last one
+	if (strm.avail_in != 0)
+	{
+		LOG_ERROR("decompress: data after the end of the stream");
+		target.clear();
+		return false;
+	}
 
+	target.resize(size);
+	return true;
+}
 
+// Tells whether the data starts with a gzip or a zlib header.
+// The pbf tiles without one are stored uncompressed.
+static bool isCompressed(const void* data, size_t len)
+{
+	const unsigned char* p = static_cast<const unsigned char*>(data);
+	return len >= 2 &&
+		((p[0] == 0x1f && p[1] == 0x8b) || ((p[0] & 0x0f) == Z_DEFLATED && (p[0] * 256 + p[1]) % 31 == 0));
+}
 
-static optional<std::string> getTile(Database& database, int zoom_level, int tile_column, int tile_row)
+// Returns the size of the data once decompressed, without decompressing it, or -1 if it isn't known.
+// Only the gzip format stores it: the last 4 bytes of a gzip member hold the size modulo 2^32.
+// It is the size of the tile served by decompress(), which only accepts a single member
+// and whose output is checked against that size by zlib; tiles are far smaller than 4GB.
+// A size deflate can't reach (over about 1032 times the compressed size) comes from a truncated
+// or corrupt tile, it isn't known then; a corrupt tile whose trailer looks right gets its size,
+// and reading it fails.
+static int decompressedSize(const void* data, size_t len)
 {
-	LOG_TRACE("getTile: zoom_level: %i, tile_column: %i, tile_row: %i",
-		zoom_level, tile_column, tile_row);
+	const unsigned char* p = static_cast<const unsigned char*>(data);
+	if (len < 18 || p[0] != 0x1f || p[1] != 0x8b || p[2] != Z_DEFLATED || (p[3] & 0xe0) != 0)
+		return -1;
+
+	p += len - 4;
+	uint32_t size = p[0] | (p[1] << 8) | (p[2] << 16) | (uint32_t(p[3]) << 24);
+	if (size > INT_MAX || size > uint64_t(len) * 1032)
+		return -1;
+	return int(size);
+}
+
 
+// Looks up the tile with the query, which must select from the 'tiles' table by zoom_level, tile_column and tile_row.
+// Returns the statement positioned on the tile row, or nullptr if there is no such tile.
+// The caller must sqlite3_reset() the statement.
+static sqlite3_stmt* selectTile(Database& database, const char* query, int zoom_level, int tile_column, int tile_row)
+{
 	assert(zoom_level >= 0);
 	assert(tile_column >= 0);
 	assert(tile_row >= 0);
 
-	optional<std::string> ret;
-
-	sqlite3_stmt* select = nullptr;
-	int rc = sqlite3_prepare_v2(database,
-		"SELECT tile_data FROM tiles WHERE zoom_level = ? AND tile_column = ? AND tile_row = ?",
-		-1, &select, nullptr);
-	if (rc != SQLITE_OK)
-	{
-		LOG_ERROR("sqlite3_prepare_v2 failed: %s", database.errmsg());
-		return ret;
-	}
+	sqlite3_stmt* select = database.statement(query);
+	if ( ! select)
+		return nullptr;
 
 	sqlite3_bind_int(select, 1, zoom_level);
 	sqlite3_bind_int(select, 2, tile_column);
 	sqlite3_bind_int(select, 3, tile_row);
 
-	if (sqlite3_step(select) == SQLITE_ROW)
-	{
-		const char* data = reinterpret_cast<const char*>(sqlite3_column_blob(select, 0));
-		int len = sqlite3_column_bytes(select, 0);
-		ret = std::string(data, len);
-	}
-
-	sqlite3_finalize(select);
+	TRACE_SPAN("step");
 
-	if (ret && ext == "pbf")
+	if (sqlite3_step(select) != SQLITE_ROW)
 	{
-		std::stringstream in(*ret);
-
-		// Decompress the tile
-		in.seekg(0, std::ios::beg);
-		std::string value;
-		if (decompress(in, value))
-		{
-			ret = value;
-		}
-		else
-		{
-			LOG_ERROR("decompress failed");
-		}
+		sqlite3_reset(select);
+		return nullptr;
 	}
 
-	return ret;
+	return select;
 }
 
+static const char* const SELECT_TILE_DATA =
+	"SELECT tile_data FROM tiles WHERE zoom_level = ? AND tile_column = ? AND tile_row = ?";
 
-static int getTileOriginalSize(Database& database, int zoom_level, int tile_column, int tile_row)
+// Gets the tile as it is stored in the 'tiles' table, without decompression
+static bool getTileData(Database& database, int zoom_level, int tile_column, int tile_row, std::string& data)
 {
-	LOG_TRACE("getTileOriginalSize: zoom_level: %i, tile_column: %i, tile_row: %i",
+	LOG_TRACE("getTileData: zoom_level: %i, tile_column: %i, tile_row: %i",
 		zoom_level, tile_column, tile_row);
 
-	assert(zoom_level >= 0);
-	assert(tile_column >= 0);
-	assert(tile_row >= 0);
-
-	int size = -1;
+	sqlite3_stmt* select = selectTile(database, SELECT_TILE_DATA, zoom_level, tile_column, tile_row);
+	if ( ! select)
+		return false;
 
-	sqlite3_stmt* select = nullptr;
-	int rc = sqlite3_prepare_v2(database,
-		"SELECT length(tile_data) FROM tiles WHERE zoom_level = ? AND tile_column = ? AND tile_row = ?",
-		-1, &select, nullptr);
-	if (rc != SQLITE_OK)
-	{
-		LOG_ERROR("sqlite3_prepare_v2 failed: %s", database.errmsg());
-		return -1;
-	}
-	sqlite3_bind_int(select, 1, zoom_level);
-	sqlite3_bind_int(select, 2, tile_column);
-	sqlite3_bind_int(select, 3, tile_row);
+	data.assign(reinterpret_cast<const char*>(sqlite3_column_blob(select, 0)), sqlite3_column_bytes(select, 0));
 
-	if (sqlite3_step(select) == SQLITE_ROW)
-		size = sqlite3_column_int(select, 0);
+	sqlite3_reset(select);
 
-	sqlite3_finalize(select);
+	return true;
+}
 
-	return size;
+// FNV-1a hash of the tile as it is stored
+static uint64_t hashTileData(const void* data, size_t len)
+{
+	const unsigned char* p = static_cast<const unsigned char*>(data);
+	uint64_t hash = 0xcbf29ce484222325ull;
+	for (size_t i = 0; i < len; ++i)
+		hash = (hash ^ p[i]) * 0x100000001b3ull;
+	return hash;
 }
 
-static int getTileSize(Database& database, int zoom_level, int tile_column, int tile_row)
+// Makes the stored tile ready to be read: compressed pbf tiles are decompressed,
+// the other tiles are served as they are stored.
+// Returns false if the tile is compressed but can't be decompressed.
+static bool decodeTile(const Archive& archive, const char* data, int len, std::string& tile)
 {
-	LOG_TRACE("getTileSize: zoom_level: %i, tile_column: %i, tile_row: %i",
-		zoom_level, tile_column, tile_row);
+	if (archive.ext != "pbf" || ! isCompressed(data, len))
+	{
+		tile.assign(data, len);
+		return true;
+	}
 
-	if (ext == "pbf")
+	if ( ! decompress(data, len, tile))
 	{
-		optional<std::string> tile = getTile(database, zoom_level, tile_column, tile_row);
-		if (tile)
-			return tile->size();
+		LOG_ERROR("decompress failed");
+		return false;
 	}
-	else
-		return getTileOriginalSize(database, zoom_level, tile_column, tile_row);
 
-	return -1;
+	return true;
 }
 
-void* mbtiles_init(struct fuse_conn_info *conn)
+// Gets the tile ready to be read: pbf tiles are decompressed.
+// Returns 0, -ENOENT if there is no such tile, or -EIO if the tile can't be decompressed.
+// The tile buffer is reused, so the tile is read without allocating memory once the buffer is big enough,
+// apart from the allocations of SQLite itself while stepping the statement.
+static int getTile(Database& database, int zoom_level, int tile_column, int tile_row, std::string& tile)
 {
-	LOG_TRACE("mbtiles_init: conn: %X", conn);
+	LOG_TRACE("getTile: zoom_level: %i, tile_column: %i, tile_row: %i",
+		zoom_level, tile_column, tile_row);
 
-	Database database;
+	TRACE_SPAN("getTile");
 
-	minLevel = getMetaDataInt(database, "minzoom");
-	if ( ! minLevel)
-	{
-		LOG_ERROR("getMetaData(minzoom) failed: %s", database.errmsg());
-		return nullptr;
-	}
+	const Archive& archive = database.archive();
+	const bool cached = archive.ext == "pbf" && shm_cache;
 
-	maxLevel = getMetaDataInt(database, "maxzoom");
-	if ( ! maxLevel)
+	// the shared cache is keyed by the hash of the stored tile, known without a query once the tile was read
+	uint64_t hash = 0;
+	const bool hashed = cached && archive.hashes.find(zoom_level, tile_column, tile_row, hash);
+	if (hashed)
 	{
-		LOG_ERROR("getMetaData(maxzoom) failed: %s", database.errmsg());
-		return nullptr;
+		TRACE_SPAN("shm_cache");
+		if (shm_cache->find(hash, zoom_level, tile_column, tile_row, tile))
+			return 0;
 	}
 
-	optional<std::string> format = getMetaDataString(database, "format");
-	if ( ! format)
-	{
-		LOG_ERROR("getMetaData(format) failed: %s", database.errmsg());
-		return nullptr;
-	}
-	if ( ! (*format == "png" || *format == "jpg" || *format == "pbf"))
+	sqlite3_stmt* select = selectTile(database, SELECT_TILE_DATA, zoom_level, tile_column, tile_row);
+	if ( ! select)
+		return -ENOENT;
+
+	const char* data = reinterpret_cast<const char*>(sqlite3_column_blob(select, 0));
+	int len = sqlite3_column_bytes(select, 0);
+
+	if (cached && ! hashed)
 	{
-		LOG_ERROR("unsupported format: %s", format->c_str());
-		return nullptr;
+		hash = hashTileData(data, len);
+		archive.hashes.insert(zoom_level, tile_column, tile_row, hash);
+
+		// decoded by another instance, or unchanged since the previous version of the file
+		TRACE_SPAN("shm_cache");
+		if (shm_cache->find(hash, zoom_level, tile_column, tile_row, tile))
+		{
+			sqlite3_reset(select);
+			return 0;
+		}
 	}
 
-	ext = *format;
+	int rc = 0;
+	if ( ! decodeTile(archive, data, len, tile))
+		rc = -EIO;
+	else if (cached)
+		shm_cache->insert(hash, zoom_level, tile_column, tile_row, tile);
 
-	return nullptr;
+	sqlite3_reset(select);
+
+	return rc;
 }
 
-int mbtiles_getattr(const char *path, struct stat *stbuf)
+// Buffer of the calling thread for the tiles that are not kept after use,
+// to be trimmed with trimBuffer() when done
+static std::string& threadBuffer()
 {
-	LOG_TRACE("mbtiles_getattr: path: %s", path);
+	thread_local std::string buffer;
+	return buffer;
+}
 
-	memset(stbuf, 0, sizeof(struct stat));
 
-	int zoom_level = -1;
-	int tile_column = -1;
-	int tile_row = -1;
-	sscanf(path, "/%i/%i/%i", &zoom_level, &tile_column, &tile_row);
+// Inflates a pbf tile incrementally, as the reader advances through it.
+// Only the stored blob and the inflate state are kept in memory:
+// the output goes straight to the reader's buffer, and seeking backwards restarts the inflate.
+class TileStream
+{
+public:
+	explicit TileStream(std::string data)
+		: data_(std::move(data))
+	{
+		strm_.zalloc = Z_NULL;
+		strm_.zfree = Z_NULL;
+		strm_.opaque = Z_NULL;
+		strm_.avail_in = 0;
+		strm_.next_in = Z_NULL;
 
-	//	directory
-	if (tile_row == -1)
+		// a tile without a zlib or gzip header is served as is, just like getTile() does
+		compressed_ = isCompressed(data_.data(), data_.size());
+
+		if (compressed_ && inflateInit2(&strm_, 15 + 32) != Z_OK) // autodected zlib or gzip header
+		{
+			LOG_ERROR("TileStream: failed to init");
+			compressed_ = false;
+		}
+		rewind();
+	}
+
+	~TileStream()
 	{
-		stbuf->st_mode = S_IFDIR | 0555;
-		stbuf->st_nlink = 2;
-		return 0;
+		if (compressed_)
+			(void)inflateEnd(&strm_);
 	}
 
-	//	file
-	Database database;
+	TileStream(const TileStream&) = delete;
+	TileStream& operator=(const TileStream&) = delete;
 
-	tile_row = (1 << zoom_level) - 1 - tile_row;
-	int len = getTileSize(database, zoom_level, tile_column, tile_row);
-	if (len >= 0)
+	// Returns the number of bytes read, 0 at the end of the tile,
+	// or -EIO if the tile can't be decompressed, just like getTile()
+	int read(char* buf, size_t size, off_t offset)
 	{
-		stbuf->st_mode = S_IFREG | 0444;
-		stbuf->st_nlink = 1;
-		stbuf->st_size = len;
-
-		return 0;
-	}
+		if ( ! compressed_)
+		{
+			if (static_cast<size_t>(offset) >= data_.size())
+				return 0;
+			size = std::min(size, data_.size() - offset);
+			memcpy(buf, data_.data() + offset, size);
+			return size;
+		}
 
-	return -ENOENT;
-}
+		TRACE_SPAN("decompress");
 
-int mbtiles_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-	off_t offset, struct fuse_file_info *fi)
-{
-	LOG_TRACE("mbtiles_readdir: path: %s", path);
+		if (offset < position_)
+			rewind();
 
-	(void)offset;
-	(void)fi;
+		// skip up to the offset
+		unsigned char skip[CHUNK];
+		while (position_ < offset && ! end_)
+		{
+			size_t have = inflateTo(skip, std::min<off_t>(CHUNK, offset - position_));
+			if (error_)
+				return -EIO;
+			if (have == 0)
+				break;
+		}
 
-	int zoom_level = -1;
-	int tile_column = -1;
-	int tile_row = -1;
-	assert(path[0] == '/');
-	sscanf(path, "/%i/%i/%i", &zoom_level, &tile_column, &tile_row);
+		size_t done = 0;
+		while (done < size && ! end_)
+		{
+			size_t have = inflateTo(reinterpret_cast<unsigned char*>(buf) + done, size - done);
+			if (error_)
+				return -EIO;
+			if (have == 0)
+				break;
+			done += have;
+		}
 
-	Database database;
+		return done;
+	}
 
-	if (zoom_level == -1)
+private:
+	void rewind()
 	{
-		filler(buf, ".", nullptr, 0);
-		filler(buf, "..", nullptr, 0);
+		if (compressed_)
+			(void)inflateReset(&strm_);
+		strm_.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data_.data()));
+		strm_.avail_in = data_.size();
+		position_ = 0;
+		end_ = ! compressed_;
+		error_ = false;
+	}
 
-		if ( ! compute_levels && minLevel && maxLevel)
+	size_t inflateTo(unsigned char* out, size_t size)
+	{
+		strm_.next_out = out;
+		strm_.avail_out = size;
+		int ret = inflate(&strm_, Z_NO_FLUSH);
+		switch (ret)
 		{
-			for (int level = *minLevel; level <= *maxLevel; ++level)
-				filler(buf, std::to_string(level).c_str(), nullptr, 0);
+		case Z_STREAM_END:
+			end_ = true;
+			if (strm_.avail_in != 0) // as in decompress()
+			{
+				LOG_ERROR("TileStream: data after the end of the stream");
+				error_ = true;
+				return 0;
+			}
+			break;
+		case Z_NEED_DICT:
+		case Z_DATA_ERROR:
+		case Z_MEM_ERROR:
+		case Z_BUF_ERROR: // truncated tile, no progress possible
+			LOG_ERROR("TileStream: inflate failed: %i", ret);
+			error_ = true;
+			return 0;
+		}
+		size_t have = size - strm_.avail_out;
+		position_ += have;
+		return have;
+	}
+
+	std::string data_;
+	z_stream strm_;
+	bool compressed_;
+	off_t position_;
+	bool end_;
+	bool error_;
+};
+
+static int getTileOriginalSize(Database& database, int zoom_level, int tile_column, int tile_row)
+{
+	LOG_TRACE("getTileOriginalSize: zoom_level: %i, tile_column: %i, tile_row: %i",
+		zoom_level, tile_column, tile_row);
+
+	sqlite3_stmt* select = selectTile(database,
+		"SELECT length(tile_data) FROM tiles WHERE zoom_level = ? AND tile_column = ? AND tile_row = ?",
+		zoom_level, tile_column, tile_row);
+	if ( ! select)
+		return -1;
+
+	int size = sqlite3_column_int(select, 0);
+
+	sqlite3_reset(select);
+
+	return size;
+}
+
+static int getTileSize(Database& database, int zoom_level, int tile_column, int tile_row)
+{
+	LOG_TRACE("getTileSize: zoom_level: %i, tile_column: %i, tile_row: %i",
+		zoom_level, tile_column, tile_row);
+
+	TRACE_SPAN("getTileSize");
+
+	int size = -1;
+	if (database.archive().sizes.find(zoom_level, tile_column, tile_row, size))
+		return size;
+
+	if (database.archive().ext == "pbf")
+	{
+		sqlite3_stmt* select = selectTile(database, SELECT_TILE_DATA, zoom_level, tile_column, tile_row);
+		if ( ! select)
+			return -1;
+		const void* data = sqlite3_column_blob(select, 0);
+		const int len = sqlite3_column_bytes(select, 0);
+		size = decompressedSize(data, len);
+		// the other tiles are not decompressed to get their size in streaming mode
+		if (size < 0 && streaming)
+			size = len;
+
+		uint64_t hash = 0;
+		if (size < 0)
+		{
+			hash = hashTileData(data, len);
+			database.archive().hashes.insert(zoom_level, tile_column, tile_row, hash);
+
+			DecodedSize decoded;
+			if (decoded_sizes.find(zoom_level, tile_column, tile_row, decoded) && decoded.data_hash == hash)
+				size = decoded.size;
+		}
+		sqlite3_reset(select);
+
+		if (size < 0)
+		{
+			std::string& tile = threadBuffer();
+			const int rc = getTile(database, zoom_level, tile_column, tile_row, tile);
+			if (rc == 0)
+			{
+				size = tile.size();
+				decoded_sizes.insert(zoom_level, tile_column, tile_row, DecodedSize{hash, size});
+			}
+			else if (rc == -EIO) // a corrupt tile without a plausible trailer
+				size = getTileOriginalSize(database, zoom_level, tile_column, tile_row); // so that reading it reports the error
+			trimBuffer(tile);
+		}
+	}
+	else
+		size = getTileOriginalSize(database, zoom_level, tile_column, tile_row);
+
+	return size;
+}
+
+// Hash of the tile as it is stored, computed once per version of the file (or by getTile())
+static bool getTileHash(Database& database, int zoom_level, int tile_column, int tile_row, uint64_t& hash)
+{
+	LOG_TRACE("getTileHash: zoom_level: %i, tile_column: %i, tile_row: %i",
+		zoom_level, tile_column, tile_row);
+
+	TRACE_SPAN("getTileHash");
+
+	const Archive& archive = database.archive();
+	if (archive.hashes.find(zoom_level, tile_column, tile_row, hash))
+		return true;
+
+	sqlite3_stmt* select = selectTile(database, SELECT_TILE_DATA, zoom_level, tile_column, tile_row);
+	if ( ! select)
+		return false;
+
+	hash = hashTileData(sqlite3_column_blob(select, 0), sqlite3_column_bytes(select, 0));
+
+	sqlite3_reset(select);
+
+	archive.hashes.insert(zoom_level, tile_column, tile_row, hash);
+	return true;
+}
+
+// Reads the metadata of the MBTiles file.
+// Returns the new Archive even if some of the metadata is missing,
+// 'ok' tells whether the file is usable.
+static std::shared_ptr<Archive> loadArchive(const std::string& filename, bool& ok)
+{
+	LOG_TRACE("loadArchive: filename: %s", filename.c_str());
+
+	ok = false;
+
+	auto archive = std::make_shared<Archive>();
+	archive->filename = filename;
+
+	struct stat st;
+	if (stat(filename.c_str(), &st) == 0)
+	{
+		// a republished file gets a new id, so that the extract journal of the previous version is discarded
+		const uint64_t fields[] = {uint64_t(st.st_dev), uint64_t(st.st_ino), uint64_t(st.st_size),
+			uint64_t(st.st_mtim.tv_sec), uint64_t(st.st_mtim.tv_nsec)};
+		uint64_t id = 0xcbf29ce484222325ull; // FNV-1a
+		for (uint64_t field : fields)
+			id = (id ^ field) * 0x100000001b3ull;
+		archive->id = id;
+		archive->mtime = st.st_mtim;
+	}
+
+	Database database(archive);
+
+	archive->minLevel = getMetaDataInt(database, "minzoom");
+	if ( ! archive->minLevel)
+	{
+		LOG_ERROR("getMetaData(minzoom) failed: %s", database.errmsg());
+		return archive;
+	}
+
+	archive->maxLevel = getMetaDataInt(database, "maxzoom");
+	if ( ! archive->maxLevel)
+	{
+		LOG_ERROR("getMetaData(maxzoom) failed: %s", database.errmsg());
+		return archive;
+	}
+
+	optional<std::string> format = getMetaDataString(database, "format");
+	if ( ! format)
+	{
+		LOG_ERROR("getMetaData(format) failed: %s", database.errmsg());
+		return archive;
+	}
+	if ( ! (*format == "png" || *format == "jpg" || *format == "pbf"))
+	{
+		LOG_ERROR("unsupported format: %s", format->c_str());
+		return archive;
+	}
+
+	archive->ext = *format;
+
+	ok = true;
+	return archive;
+}
+
+// Swaps in the current version of the MBTiles file.
+// A file that can't be read is ignored and the previous version stays mounted.
+static void reloadArchive()
+{
+	LOG_DEBUG("reloadArchive: filename: %s", mbtiles_filename.c_str());
+
+	bool ok;
+	std::shared_ptr<Archive> archive = loadArchive(mbtiles_filename, ok);
+	if ( ! ok)
+	{
+		LOG_WARNING("reloadArchive: %s is not usable, keeping the previous version", mbtiles_filename.c_str());
+		return;
+	}
+
+	setCurrentArchive(std::move(archive));
+}
+
+
+// The watcher thread reloads the archive when requested through wakeup_pipe
+// (by the SIGUSR1 handler) or when inotify reports that the file was rewritten or renamed over.
+// It also dumps the trace when requested by the SIGUSR2 handler.
+static int wakeup_pipe[2] = {-1, -1};
+static std::thread watcher;
+
+enum : char
+{
+	WAKEUP_RELOAD = 'r',
+	WAKEUP_DUMP_TRACE = 't',
+	WAKEUP_QUIT = 'q',
+};
+
+static void wakeup(char cmd)
+{
+	// async-signal-safe, may be called from a signal handler
+	ssize_t rc = write(wakeup_pipe[1], &cmd, 1);
+	(void)rc;
+}
+
+static void onReloadSignal(int)
+{
+	wakeup(WAKEUP_RELOAD);
+}
+
+static void onDumpTraceSignal(int)
+{
+	wakeup(WAKEUP_DUMP_TRACE);
+}
+
+static void dumpTrace()
+{
+	if (trace_file.empty())
+		return;
+
+	LOG_DEBUG("dumpTrace: %s", trace_file.c_str());
+
+	if ( ! Tracer::dump(trace_file))
+	{
+		LOG_ERROR("can't write trace file %s", trace_file.c_str());
+	}
+}
+
+static void watcherLoop()
+{
+	int inotify_fd = -1;
+	std::string name;
+	if (watch)
+	{
+		// Watch the directory rather than the file itself:
+		// the file is usually republished by renaming a new one over it.
+		std::string dir = mbtiles_filename;
+		dir = dirname(&dir[0]);
+		name = mbtiles_filename;
+		name = basename(&name[0]);
+
+		inotify_fd = inotify_init1(IN_CLOEXEC);
+		if (inotify_fd < 0 ||
+			inotify_add_watch(inotify_fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+		{
+			LOG_ERROR("inotify failed for %s: %s", dir.c_str(), strerror(errno));
+		}
+	}
+
+	bool changed = false;
+	for (;;)
+	{
+		pollfd fds[2] = {{wakeup_pipe[0], POLLIN, 0}, {inotify_fd, POLLIN, 0}};
+		// wait for the writer to settle down before reloading a changed file
+		int rc = poll(fds, inotify_fd < 0 ? 1 : 2, changed ? 500 : -1);
+		if (rc < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			LOG_ERROR("poll failed: %s", strerror(errno));
+			break;
+		}
+
+		if (rc == 0)
+		{
+			changed = false;
+			reloadArchive();
+			continue;
+		}
+
+		if (fds[0].revents & POLLIN)
+		{
+			char cmd;
+			if (read(wakeup_pipe[0], &cmd, 1) != 1 || cmd == WAKEUP_QUIT)
+				break;
+			if (cmd == WAKEUP_RELOAD)
+				reloadArchive();
+			else if (cmd == WAKEUP_DUMP_TRACE)
+				dumpTrace();
+		}
+
+		if (inotify_fd >= 0 && (fds[1].revents & POLLIN))
+		{
+			alignas(inotify_event) char events[4096];
+			ssize_t len = read(inotify_fd, events, sizeof(events));
+			for (ssize_t i = 0; i < len; )
+			{
+				const inotify_event* event = reinterpret_cast<const inotify_event*>(events + i);
+				if (event->len && name == event->name)
+					changed = true;
+				i += sizeof(inotify_event) + event->len;
+			}
+		}
+	}
+
+	if (inotify_fd >= 0)
+		close(inotify_fd);
+}
+
+void* mbtiles_init(struct fuse_conn_info *conn)
+{
+	LOG_TRACE("mbtiles_init: conn: %X", conn);
+
+	bool ok;
+	setCurrentArchive(loadArchive(mbtiles_filename, ok));
+
+	if (sched_workers)
+		scheduler.reset(new Scheduler(sched_workers, sched_weights));
+
+	// fuse_main has daemonized by now, so it's safe to start threads
+	if (pipe2(wakeup_pipe, O_CLOEXEC) == 0)
+	{
+		struct sigaction sa{};
+		sa.sa_handler = onReloadSignal;
+		sigemptyset(&sa.sa_mask);
+		sa.sa_flags = SA_RESTART;
+		sigaction(SIGUSR1, &sa, nullptr);
+
+		if ( ! trace_file.empty())
+		{
+			sa.sa_handler = onDumpTraceSignal;
+			sigaction(SIGUSR2, &sa, nullptr);
+		}
+
+		watcher = std::thread(watcherLoop);
+	}
+	else
+	{
+		LOG_ERROR("pipe2 failed: %s", strerror(errno));
+	}
+
+	return nullptr;
+}
+
+void mbtiles_destroy(void *private_data)
+{
+	LOG_TRACE("mbtiles_destroy");
+
+	(void)private_data;
+
+	if (watcher.joinable())
+	{
+		signal(SIGUSR1, SIG_IGN);
+		signal(SIGUSR2, SIG_IGN);
+		wakeup(WAKEUP_QUIT);
+		watcher.join();
+	}
+
+	scheduler.reset();
+
+	dumpTrace();
+}
+
+static int getAttr(const char *path, struct stat *stbuf)
+{
+	LOG_TRACE("mbtiles_getattr: path: %s", path);
+
+	TRACE_SPAN("mbtiles_getattr");
+
+	memset(stbuf, 0, sizeof(struct stat));
+
+	int zoom_level = -1;
+	int tile_column = -1;
+	int tile_row = -1;
+	sscanf(path, "/%i/%i/%i", &zoom_level, &tile_column, &tile_row);
+
+	Database& database = threadDatabase();
+
+	// stable as long as the MBTiles file isn't republished
+	stbuf->st_atim = stbuf->st_mtim = stbuf->st_ctim = database.archive().mtime;
+
+	//	directory
+	if (tile_row == -1)
+	{
+		stbuf->st_mode = S_IFDIR | 0555;
+		stbuf->st_nlink = 2;
+		return 0;
+	}
+
+	//	file
+
+	tile_row = (1 << zoom_level) - 1 - tile_row;
+	int len = getTileSize(database, zoom_level, tile_column, tile_row);
+	if (len >= 0)
+	{
+		stbuf->st_mode = S_IFREG | 0444;
+		stbuf->st_nlink = 1;
+		stbuf->st_size = len;
+
+		return 0;
+	}
+
+	return -ENOENT;
+}
+
+static int readDir(const char *path, void *buf, fuse_fill_dir_t filler,
+	off_t offset, struct fuse_file_info *fi)
+{
+	LOG_TRACE("mbtiles_readdir: path: %s", path);
+
+	TRACE_SPAN("mbtiles_readdir");
+
+	(void)offset;
+	(void)fi;
+
+	int zoom_level = -1;
+	int tile_column = -1;
+	int tile_row = -1;
+	assert(path[0] == '/');
+	sscanf(path, "/%i/%i/%i", &zoom_level, &tile_column, &tile_row);
+
+	Database& database = threadDatabase();
+
+	if (zoom_level == -1)
+	{
+		filler(buf, ".", nullptr, 0);
+		filler(buf, "..", nullptr, 0);
+
+		const Archive& archive = database.archive();
+		if ( ! compute_levels && archive.minLevel && archive.maxLevel)
+		{
+			for (int level = *archive.minLevel; level <= *archive.maxLevel; ++level)
+				filler(buf, std::to_string(level).c_str(), nullptr, 0);
 		}
 		else
 		{
 			sqlite3_stmt* select = nullptr;
-			int rc = sqlite3_prepare_v2(database,
-				"SELECT DISTINCT zoom_level FROM tiles",
-				-1, &select, nullptr);
+			int rc;
+			{
+				TRACE_SPAN("prepare");
+				rc = sqlite3_prepare_v2(database,
+					"SELECT DISTINCT zoom_level FROM tiles",
+					-1, &select, nullptr);
+			}
 			if (rc != SQLITE_OK)
 			{
 				LOG_ERROR("sqlite3_prepare_v2 failed: %s", database.errmsg());
 				return 1;
 			}
 
-			while (sqlite3_step(select) == SQLITE_ROW)
-				filler(buf, reinterpret_cast<const char*>(sqlite3_column_text(select, 0)), nullptr, 0);
+			{
+				TRACE_SPAN("step");
+				while (sqlite3_step(select) == SQLITE_ROW)
+					filler(buf, reinterpret_cast<const char*>(sqlite3_column_text(select, 0)), nullptr, 0);
+			}
 
 			sqlite3_finalize(select);
 		}
@@ -437,9 +1259,13 @@ int mbtiles_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 		filler(buf, "..", nullptr, 0);
 
 		sqlite3_stmt* select = nullptr;
-		int rc = sqlite3_prepare_v2(database,
-			"SELECT DISTINCT tile_column FROM tiles WHERE zoom_level = ?",
-			-1, &select, nullptr);
+		int rc;
+		{
+			TRACE_SPAN("prepare");
+			rc = sqlite3_prepare_v2(database,
+				"SELECT DISTINCT tile_column FROM tiles WHERE zoom_level = ?",
+				-1, &select, nullptr);
+		}
 		if (rc != SQLITE_OK)
 		{
 			LOG_ERROR("sqlite3_prepare_v2 failed: %s", database.errmsg());
@@ -448,8 +1274,11 @@ int mbtiles_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 
 		sqlite3_bind_int(select, 1, zoom_level);
 
-		while (sqlite3_step(select) == SQLITE_ROW)
-			filler(buf, reinterpret_cast<const char*>(sqlite3_column_text(select, 0)), nullptr, 0);
+		{
+			TRACE_SPAN("step");
+			while (sqlite3_step(select) == SQLITE_ROW)
+				filler(buf, reinterpret_cast<const char*>(sqlite3_column_text(select, 0)), nullptr, 0);
+		}
 
 		sqlite3_finalize(select);
 
@@ -461,81 +1290,373 @@ int mbtiles_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 		filler(buf, ".", nullptr, 0);
 		filler(buf, "..", nullptr, 0);
 
+		// The sizes of the tiles are listed along with the tiles:
+		// they are passed to the filler and kept for the getattr calls that usually follow the listing.
+		// The size of a pbf tile is in its gzip trailer, so only the tiles up to about a page are selected whole:
+		// they are mostly stored in the b-tree pages the listing reads anyway, while the bigger ones
+		// would have to be read from their overflow pages; their size is left for getattr.
+		const Archive& archive = database.archive();
+		const bool pbf = archive.ext == "pbf";
+
 		sqlite3_stmt* select = nullptr;
-		int rc = sqlite3_prepare_v2(database,
-			"SELECT tile_row FROM tiles WHERE zoom_level = ? AND tile_column = ?",
-			-1, &select, nullptr);
+		int rc;
+		{
+			TRACE_SPAN("prepare");
+			rc = sqlite3_prepare_v2(database,
+				pbf ?
+					"SELECT tile_row, length(tile_data), CASE WHEN length(tile_data) <= 4096 THEN tile_data END FROM tiles WHERE zoom_level = ? AND tile_column = ?" :
+					"SELECT tile_row, length(tile_data) FROM tiles WHERE zoom_level = ? AND tile_column = ?",
+				-1, &select, nullptr);
+		}
 		if (rc != SQLITE_OK)
 		{
 			LOG_ERROR("sqlite3_prepare_v2 failed: %s", database.errmsg());
 			return 1;
 		}
 
-		sqlite3_bind_int(select, 1, zoom_level);
-		sqlite3_bind_int(select, 2, tile_column);
+		sqlite3_bind_int(select, 1, zoom_level);
+		sqlite3_bind_int(select, 2, tile_column);
+
+		struct stat st;
+		memset(&st, 0, sizeof(struct stat));
+		st.st_nlink = 1;
+		st.st_atim = st.st_mtim = st.st_ctim = archive.mtime;
+
+		TRACE_SPAN("step");
+		while (sqlite3_step(select) == SQLITE_ROW)
+		{
+			const int row = sqlite3_column_int(select, 0);
+			int size = sqlite3_column_int(select, 1);
+			if (pbf)
+			{
+				const int stored = size;
+				size = decompressedSize(sqlite3_column_blob(select, 2), sqlite3_column_bytes(select, 2));
+				// as in getTileSize(), streaming mode reports the stored size of the tiles without a gzip trailer;
+				// the big tiles are not selected, their size is left for getattr
+				if (size < 0 && streaming && sqlite3_column_type(select, 2) != SQLITE_NULL)
+					size = stored;
+			}
+
+			if (size >= 0)
+			{
+				archive.sizes.insert(zoom_level, tile_column, row, size);
+				st.st_mode = S_IFREG | 0444;
+				st.st_size = size;
+			}
+			else
+			{
+				// unknown until decompressed, left for getattr
+				st.st_mode = 0;
+				st.st_size = 0;
+			}
+
+			std::string str = std::to_string((1 << zoom_level) - 1 - row) + "." + archive.ext;
+			filler(buf, str.c_str(), st.st_mode ? &st : nullptr, 0);
+		}
+
+		sqlite3_finalize(select);
+
+		return 0;
+	}
+
+	return -ENOENT;
+}
+
+// State of an open tile file, kept in fuse_file_info::fh.
+// The file is bound to the version of the MBTiles file that was current at open time,
+// so reads of an open file are not affected by a reload.
+// It is read through the connection of the reading thread to that version.
+struct OpenFile
+{
+	int zoom_level;
+	int tile_column;
+	int tile_row;
+
+	// reads of the same file may come from different threads
+	std::mutex mutex;
+	std::shared_ptr<const Archive> archive;
+
+	// streaming mode, created by the first read
+	bool streaming = false;
+	std::unique_ptr<TileStream> stream;
+
+	// otherwise, the tile is read once by the first read and kept until the file is closed
+	bool loaded = false;
+	int error = 0; // of getTile()
+	std::string tile;
+};
+
+int mbtiles_open(const char *path, struct fuse_file_info *fi)
+{
+	LOG_TRACE("mbtiles_open: path: %s", path);
+
+	TRACE_SPAN("mbtiles_open");
+
+	if (scheduler && strcmp(path, SCHEDULER_STATS_PATH) == 0)
+	{
+		// generated on every read
+		fi->direct_io = 1;
+		fi->fh = 0;
+		return 0;
+	}
+
+	int zoom_level = -1;
+	int tile_column = -1;
+	int tile_row = -1;
+	sscanf(path, "/%i/%i/%i.", &zoom_level, &tile_column, &tile_row);
+	if (tile_row == -1)
+		return -ENOENT;
+
+	//	TODO: check data availability
+	tile_row = (1 << zoom_level) - 1 - tile_row;
+
+	if ((fi->flags & 3) != O_RDONLY)
+		return -EACCES;
+
+	OpenFile* file = new OpenFile;
+	file->zoom_level = zoom_level;
+	file->tile_column = tile_column;
+	file->tile_row = tile_row;
+	file->archive = currentArchive();
+	++file->archive->open_files;
+	fi->fh = reinterpret_cast<uint64_t>(file);
+
+	// the size reported by getattr isn't the real one, the kernel must read up to EOF
+	if (streaming && file->archive->ext == "pbf")
+	{
+		file->streaming = true;
+		fi->direct_io = 1;
+	}
+	else
+	{
+		file->tile = buffer_pool.acquire();
+	}
+
+	return 0;
+}
+
+int mbtiles_release(const char *path, struct fuse_file_info *fi)
+{
+	LOG_TRACE("mbtiles_release: path: %s", path);
+
+	OpenFile* file = reinterpret_cast<OpenFile*>(fi->fh);
+	if (file)
+	{
+		buffer_pool.release(std::move(file->tile));
+		--file->archive->open_files;
+		delete file;
+		fi->fh = 0;
+	}
+
+	return 0;
+}
+
+
+static int readFile(const char *path, char *buf, size_t size, off_t offset,
+	struct fuse_file_info *fi)
+{
+	LOG_TRACE("mbtiles_read: path: %s", path);
+
+	TRACE_SPAN("mbtiles_read");
+
+	OpenFile* file = reinterpret_cast<OpenFile*>(fi->fh);
+	assert(file);
+
+	std::lock_guard<std::mutex> lock(file->mutex);
 
-		while (sqlite3_step(select) == SQLITE_ROW)
+	Database& database = threadDatabase(file->archive);
+
+	if (file->streaming)
+	{
+		if ( ! file->stream)
 		{
-			const int row = sqlite3_column_int(select, 0);
-			std::string str = std::to_string((1 << zoom_level) - 1 - row) + "." + ext;
-			filler(buf, str.c_str(), nullptr, 0);
+			std::string data;
+			if ( ! getTileData(database, file->zoom_level, file->tile_column, file->tile_row, data))
+				return 0;
+			file->stream.reset(new TileStream(std::move(data)));
 		}
+		return file->stream->read(buf, size, offset);
+	}
 
-		sqlite3_finalize(select);
+	if ( ! file->loaded)
+	{
+		file->error = getTile(database, file->zoom_level, file->tile_column, file->tile_row, file->tile);
+		file->loaded = true;
+	}
 
+	if (file->error == -EIO)
+		return -EIO;
+
+	const std::string& tile = file->tile;
+	if (file->error || tile.size() <= static_cast<size_t>(offset))
 		return 0;
+
+	if (tile.size() < offset + size)
+		size = tile.size() - offset;
+
+	{
+		TRACE_SPAN("memcpy");
+		memcpy(buf, tile.data() + offset, size);
 	}
 
-	return -ENOENT;
+	return size;
 }
 
-int mbtiles_open(const char *path, struct fuse_file_info *fi)
+
+// Extended attributes of the tile files, for incremental sync tools:
+// the hash of the stored tile changes only when the tile does, and is cheaper to get than the tile itself.
+static const char* const XATTR_HASH = "user.mbtiles.hash";
+static const char* const XATTR_STORED_SIZE = "user.mbtiles.stored_size";
+
+static int getXattr(const char *path, const char *name, char *value, size_t size)
 {
-	LOG_TRACE("mbtiles_open: path: %s", path);
+	LOG_TRACE("mbtiles_getxattr: path: %s, name: %s", path, name);
+
+	TRACE_SPAN("mbtiles_getxattr");
 
 	int zoom_level = -1;
 	int tile_column = -1;
 	int tile_row = -1;
-	sscanf(path, "/%i/%i/%i.", &zoom_level, &tile_column, &tile_row);
+	sscanf(path, "/%i/%i/%i", &zoom_level, &tile_column, &tile_row);
 	if (tile_row == -1)
-		return -ENOENT;
+		return -ENODATA;
 
-	//	TODO: check data availability
 	tile_row = (1 << zoom_level) - 1 - tile_row;
+	if (tile_row < 0)
+		return -ENOENT;
 
-	if ((fi->flags & 3) != O_RDONLY)
-		return -EACCES;
+	Database& database = threadDatabase();
 
-	return 0;
-}
+	char str[32];
+	if (strcmp(name, XATTR_HASH) == 0)
+	{
+		uint64_t hash;
+		if ( ! getTileHash(database, zoom_level, tile_column, tile_row, hash))
+			return -ENOENT;
+		snprintf(str, sizeof(str), "%016llx", static_cast<unsigned long long>(hash));
+	}
+	else if (strcmp(name, XATTR_STORED_SIZE) == 0)
+	{
+		int stored_size = getTileOriginalSize(database, zoom_level, tile_column, tile_row);
+		if (stored_size < 0)
+			return -ENOENT;
+		snprintf(str, sizeof(str), "%i", stored_size);
+	}
+	else
+	{
+		return -ENODATA;
+	}
 
+	const size_t len = strlen(str);
+	if (size == 0)
+		return len;
+	if (size < len)
+		return -ERANGE;
 
-int mbtiles_read(const char *path, char *buf, size_t size, off_t offset,
-	struct fuse_file_info *fi)
+	memcpy(value, str, len);
+	return len;
+}
+
+int mbtiles_listxattr(const char *path, char *list, size_t size)
 {
-	LOG_TRACE("mbtiles_read: path: %s", path);
+	LOG_TRACE("mbtiles_listxattr: path: %s", path);
 
-	(void)fi;
-	int zoom_level = -1;
-	int tile_column = -1;
 	int tile_row = -1;
-	sscanf(path, "/%i/%i/%i.", &zoom_level, &tile_column, &tile_row);
+	sscanf(path, "/%*i/%*i/%i", &tile_row);
+	if (tile_row == -1)
+		return 0;
 
-	assert(tile_row >= 0);
-	tile_row = (1 << zoom_level) - 1 - tile_row;
+	// the names, each followed by '\0'
+	const size_t hash_len = strlen(XATTR_HASH) + 1;
+	const size_t stored_size_len = strlen(XATTR_STORED_SIZE) + 1;
+	const size_t len = hash_len + stored_size_len;
+	if (size == 0)
+		return len;
+	if (size < len)
+		return -ERANGE;
+
+	memcpy(list, XATTR_HASH, hash_len);
+	memcpy(list + hash_len, XATTR_STORED_SIZE, stored_size_len);
+	return len;
+}
+
+// The requests that access the MBTiles file are run by the scheduler, if enabled,
+// otherwise in the calling FUSE thread.
+
+static Scheduler::Class requestClass(int zoom_level, bool scan)
+{
+	if (scan)
+		return Scheduler::CLASS_BULK;
+
+	if (bulk_zoom && zoom_level >= bulk_zoom)
+		return Scheduler::CLASS_BULK;
+
+	const fuse_context* context = fuse_get_context();
+	if (context && std::find(bulk_uids.begin(), bulk_uids.end(), context->uid) != bulk_uids.end())
+		return Scheduler::CLASS_BULK;
 
-	Database database;
+	return Scheduler::CLASS_INTERACTIVE;
+}
+
+template<typename F>
+static int schedule(Scheduler::Class c, F f)
+{
+	if ( ! scheduler)
+		return f();
+
+	int ret = -EIO;
+	auto job = [&ret, &f] { ret = f(); };
+	scheduler->run(c, job);
+	return ret;
+}
 
-	optional<std::string> tile = getTile(database, zoom_level, tile_column, tile_row);
-	if ( ! tile || tile->size() <= offset)
+int mbtiles_getattr(const char *path, struct stat *stbuf)
+{
+	if (scheduler && strcmp(path, SCHEDULER_STATS_PATH) == 0)
+	{
+		memset(stbuf, 0, sizeof(struct stat));
+		stbuf->st_mode = S_IFREG | 0444;
+		stbuf->st_nlink = 1;
+		stbuf->st_size = scheduler->report().size();
 		return 0;
+	}
 
-	if (tile->size() < offset + size)
-		size = tile->size() - offset;
+	int zoom_level = -1;
+	sscanf(path, "/%i", &zoom_level);
 
-	memcpy(buf, tile->data() + offset, size);
+	return schedule(requestClass(zoom_level, false), [=] { return getAttr(path, stbuf); });
+}
 
-	return size;
+int mbtiles_getxattr(const char *path, const char *name, char *value, size_t size)
+{
+	int zoom_level = -1;
+	sscanf(path, "/%i", &zoom_level);
+
+	return schedule(requestClass(zoom_level, false), [=] { return getXattr(path, name, value, size); });
+}
+
+int mbtiles_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+	off_t offset, struct fuse_file_info *fi)
+{
+	return schedule(requestClass(-1, true), [=] { return readDir(path, buf, filler, offset, fi); });
+}
+
+int mbtiles_read(const char *path, char *buf, size_t size, off_t offset,
+	struct fuse_file_info *fi)
+{
+	OpenFile* file = reinterpret_cast<OpenFile*>(fi->fh);
+	if ( ! file)
+	{
+		// SCHEDULER_STATS_PATH
+		const std::string report = scheduler ? scheduler->report() : std::string();
+		if (report.size() <= static_cast<size_t>(offset))
+			return 0;
+		size = std::min(size, report.size() - offset);
+		memcpy(buf, report.data() + offset, size);
+		return size;
+	}
+
+	return schedule(requestClass(file->zoom_level, false), [=] { return readFile(path, buf, size, offset, fi); });
 }
 
 #ifdef USE_LOGGER
@@ -583,9 +1704,392 @@ static int createLogger(const char* logLevelStr, const char* logParamsStr)
 }
 #endif
 
+// Extract mode: writes all the tiles of the MBTiles file to a directory tree,
+// the same as the one seen through the mount point, using all the cores.
+//
+// The 'tiles' table is split into units of work: rowid ranges if it is a table,
+// or zoom levels and tile columns if it is a view (e.g. over the 'map' and 'images' tables).
+// The units are processed by the workers in parallel, each with its own connection,
+// and the completed ones are logged in EXTRACT_JOURNAL in the target directory,
+// so that an interrupted extract resumes where it stopped.
+static const char* const EXTRACT_JOURNAL = ".fuse-mbtiles-extract";
+
+class Extractor
+{
+public:
+	Extractor(std::shared_ptr<const Archive> archive, const std::string& directory)
+		: archive_(std::move(archive))
+		, directory_(directory)
+	{
+	}
+
+	int run(unsigned jobs)
+	{
+		if ( ! plan() || ! openJournal())
+			return 1;
+
+		std::cerr << "extracting " << archive_->filename << " to " << directory_ << ": "
+			<< units_.size() - done_units_ << " of " << units_.size() << " units of work left, "
+			<< jobs << " workers" << std::endl;
+
+		const auto start = std::chrono::steady_clock::now();
+
+		// set before the workers start, the progress loop below waits for it to drop to 0
+		running_ = jobs;
+		std::vector<std::thread> workers;
+		for (unsigned i = 0; i < jobs; ++i)
+			workers.emplace_back(&Extractor::work, this);
+
+		// progress
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			while ( ! finished_.wait_for(lock, std::chrono::seconds(1), [this] { return running_ == 0; }))
+				progress(start, false);
+			progress(start, true);
+		}
+
+		for (std::thread& worker : workers)
+			worker.join();
+
+		fclose(journal_);
+
+		if (failed_)
+			return 1;
+
+		if (skipped_)
+		{
+			std::cerr << "done, " << skipped_ << " tiles skipped" << std::endl;
+			return 1;
+		}
+
+		std::cerr << "done" << std::endl;
+		return 0;
+	}
+
+private:
+	struct Unit
+	{
+		// bound to the parameters of query_: the first and last rowid, or the zoom level and the tile column
+		int64_t first;
+		int64_t last;
+	};
+
+	bool plan()
+	{
+		Database database(archive_);
+
+		optional<std::string> type;
+		sqlite3_stmt* select = nullptr;
+		if (sqlite3_prepare_v2(database, "SELECT type FROM sqlite_master WHERE name = 'tiles'", -1, &select, nullptr) == SQLITE_OK &&
+			sqlite3_step(select) == SQLITE_ROW)
+		{
+			type = reinterpret_cast<const char*>(sqlite3_column_text(select, 0));
+		}
+		sqlite3_finalize(select);
+
+		if ( ! type)
+		{
+			std::cerr << "no 'tiles' table in " << archive_->filename << ": " << database.errmsg() << std::endl;
+			return false;
+		}
+
+		if (*type == "table")
+		{
+			query_ = "SELECT zoom_level, tile_column, tile_row, tile_data FROM tiles WHERE rowid BETWEEN ? AND ?";
+
+			select = nullptr;
+			if (sqlite3_prepare_v2(database, "SELECT min(rowid), max(rowid) FROM tiles", -1, &select, nullptr) == SQLITE_OK &&
+				sqlite3_step(select) == SQLITE_ROW && sqlite3_column_type(select, 0) != SQLITE_NULL)
+			{
+				const int64_t min = sqlite3_column_int64(select, 0);
+				const int64_t max = sqlite3_column_int64(select, 1);
+				for (int64_t first = min; first <= max; first += UNIT_ROWS)
+					units_.push_back(Unit{first, std::min(first + UNIT_ROWS - 1, max)});
+			}
+			sqlite3_finalize(select);
+		}
+		else
+		{
+			query_ = "SELECT zoom_level, tile_column, tile_row, tile_data FROM tiles WHERE zoom_level = ? AND tile_column = ?";
+
+			select = nullptr;
+			if (sqlite3_prepare_v2(database, "SELECT DISTINCT zoom_level, tile_column FROM tiles ORDER BY zoom_level, tile_column", -1, &select, nullptr) == SQLITE_OK)
+			{
+				while (sqlite3_step(select) == SQLITE_ROW)
+					units_.push_back(Unit{sqlite3_column_int64(select, 0), sqlite3_column_int64(select, 1)});
+			}
+			sqlite3_finalize(select);
+		}
+
+		select = nullptr;
+		if (sqlite3_prepare_v2(database, "SELECT count(*) FROM tiles", -1, &select, nullptr) == SQLITE_OK &&
+			sqlite3_step(select) == SQLITE_ROW)
+		{
+			total_tiles_ = sqlite3_column_int64(select, 0);
+		}
+		sqlite3_finalize(select);
+
+		return true;
+	}
+
+	// Reads the units completed by a previous run, if it was run on the same version of the file
+	bool openJournal()
+	{
+		if (mkdir(directory_.c_str(), 0755) != 0 && errno != EEXIST)
+		{
+			std::cerr << "can't create " << directory_ << ": " << strerror(errno) << std::endl;
+			return false;
+		}
+
+		char header[128];
+		snprintf(header, sizeof(header), "fuse-mbtiles extract %016llx %zu",
+			static_cast<unsigned long long>(archive_->id), units_.size());
+
+		const std::string journal = directory_ + "/" + EXTRACT_JOURNAL;
+
+		done_.assign(units_.size(), false);
+		done_units_ = 0;
+
+		std::ifstream in(journal);
+		std::string line;
+		if (std::getline(in, line) && line == header)
+		{
+			while (std::getline(in, line))
+			{
+				size_t unit = std::strtoul(line.c_str(), nullptr, 10);
+				if (unit < done_.size() && ! done_[unit])
+				{
+					done_[unit] = true;
+					++done_units_;
+				}
+			}
+		}
+		in.close();
+
+		journal_ = fopen(journal.c_str(), done_units_ ? "a" : "w");
+		if ( ! journal_)
+		{
+			std::cerr << "can't write " << journal << ": " << strerror(errno) << std::endl;
+			return false;
+		}
+		if ( ! done_units_)
+		{
+			fprintf(journal_, "%s\n", header);
+			fflush(journal_);
+		}
+
+		next_ = 0;
+		return true;
+	}
+
+	void work()
+	{
+		Database database(archive_);
+		sqlite3_stmt* select = nullptr;
+		if (sqlite3_prepare_v2(database, query_, -1, &select, nullptr) != SQLITE_OK)
+		{
+			std::cerr << "sqlite3_prepare_v2 failed: " << database.errmsg() << std::endl;
+			failed_ = true;
+		}
+
+		// zoom levels and tile columns whose directory is already created by this worker
+		std::unordered_set<uint64_t> directories;
+		std::string tile;
+		std::string path;
+
+		while ( ! failed_)
+		{
+			const size_t unit = next_++;
+			if (unit >= units_.size())
+				break;
+			if (done_[unit])
+				continue;
+
+			sqlite3_bind_int64(select, 1, units_[unit].first);
+			sqlite3_bind_int64(select, 2, units_[unit].last);
+
+			// a unit with skipped tiles isn't logged, so that a resumed extract retries it and fails again
+			bool skipped = false;
+			int rc;
+			while ( ! failed_ && (rc = sqlite3_step(select)) == SQLITE_ROW)
+			{
+				const int zoom_level = sqlite3_column_int(select, 0);
+				const int tile_column = sqlite3_column_int(select, 1);
+				const int tile_row = sqlite3_column_int(select, 2);
+				const char* data = reinterpret_cast<const char*>(sqlite3_column_blob(select, 3));
+				const int len = sqlite3_column_bytes(select, 3);
+
+				if ( ! decodeTile(*archive_, data, len, tile))
+				{
+					// skipped like a read of the tile through the mount point fails
+					std::cerr << "can't decompress the tile " << zoom_level << "/" << tile_column << "/"
+						<< (1 << zoom_level) - 1 - tile_row << std::endl;
+					++skipped_;
+					skipped = true;
+					continue;
+				}
+
+				path = directory_ + "/" + std::to_string(zoom_level);
+				if (directories.insert(uint64_t(zoom_level) << 32 | 0xffffffff).second)
+					makeDirectory(path);
+				path += "/" + std::to_string(tile_column);
+				if (directories.insert(uint64_t(zoom_level) << 32 | uint32_t(tile_column)).second)
+					makeDirectory(path);
+				path += "/" + std::to_string((1 << zoom_level) - 1 - tile_row) + "." + archive_->ext;
+
+				if (writeFile(path, tile))
+				{
+					++tiles_;
+					bytes_ += tile.size();
+				}
+			}
+			if ( ! failed_ && rc != SQLITE_DONE)
+			{
+				std::cerr << "sqlite3_step failed: " << database.errmsg() << std::endl;
+				failed_ = true;
+			}
+			sqlite3_reset(select);
+
+			if ( ! failed_ && ! skipped)
+			{
+				std::lock_guard<std::mutex> lock(mutex_);
+				fprintf(journal_, "%zu\n", unit);
+				fflush(journal_);
+				++done_units_;
+			}
+		}
+
+		sqlite3_finalize(select);
+
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (--running_ == 0)
+			finished_.notify_one();
+	}
+
+	void makeDirectory(const std::string& path)
+	{
+		if (mkdir(path.c_str(), 0755) != 0 && errno != EEXIST)
+		{
+			std::cerr << "can't create " << path << ": " << strerror(errno) << std::endl;
+			failed_ = true;
+		}
+	}
+
+	bool writeFile(const std::string& path, const std::string& data)
+	{
+		int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		bool ok = fd >= 0 && write(fd, data.data(), data.size()) == static_cast<ssize_t>(data.size());
+		if (fd >= 0 && close(fd) != 0)
+			ok = false;
+		if ( ! ok)
+		{
+			std::cerr << "can't write " << path << ": " << strerror(errno) << std::endl;
+			failed_ = true;
+		}
+		return ok;
+	}
+
+	// called with mutex_ locked
+	void progress(std::chrono::steady_clock::time_point start, bool last)
+	{
+		const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		char line[256];
+		snprintf(line, sizeof(line), "\r%zu/%zu units, %llu tiles of %lld, %.0f tiles/s, %.1f MB/s   ",
+			done_units_, units_.size(), static_cast<unsigned long long>(tiles_), static_cast<long long>(total_tiles_),
+			seconds > 0 ? tiles_ / seconds : 0.0, seconds > 0 ? bytes_ / seconds / (1 << 20) : 0.0);
+		std::cerr << line;
+		if (last)
+			std::cerr << std::endl;
+	}
+
+	static const int64_t UNIT_ROWS = 4096;
+
+	std::shared_ptr<const Archive> archive_;
+	std::string directory_;
+
+	const char* query_ = nullptr;
+	std::vector<Unit> units_;
+	std::vector<bool> done_; // by a previous run, read only while the workers run
+	int64_t total_tiles_ = -1;
+
+	FILE* journal_ = nullptr;
+	std::mutex mutex_;
+	std::condition_variable finished_;
+	unsigned running_ = 0;
+	size_t done_units_ = 0;
+
+	std::atomic<size_t> next_{0};
+	std::atomic<uint64_t> tiles_{0};
+	std::atomic<uint64_t> bytes_{0};
+	std::atomic<uint64_t> skipped_{0};
+	std::atomic<bool> failed_{false};
+};
+
+static void useExtract(const char *prog_name)
+{
+	std::cerr << "use: " << prog_name << " extract [-j N] <directory> <mbtiles>" << std::endl;
+	std::cerr <<
+		"extract options:\n"
+		"    -j N - number of workers (default - number of cores)\n"
+	;
+}
+
+// fuse-mbtiles extract [-j N] <directory> <mbtiles>
+static int extract(const char *prog_name, int argc, char *argv[])
+{
+	unsigned jobs = std::thread::hardware_concurrency();
+
+	int i = 1;
+	for (; i < argc && argv[i][0] == '-'; ++i)
+	{
+		if (strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+			jobs = atoi(argv[++i]);
+		else
+		{
+			useExtract(prog_name);
+			return 1;
+		}
+	}
+
+	if (argc - i != 2)
+	{
+		useExtract(prog_name);
+		return 1;
+	}
+
+#ifdef USE_LOGGER
+	int ret = createLogger(nullptr, nullptr);
+	if (ret)
+		return ret;
+#endif
+
+	const std::string directory = argv[i];
+	mbtiles_filename = argv[i + 1];
+
+	bool ok;
+	std::shared_ptr<const Archive> archive = loadArchive(mbtiles_filename, ok);
+	if ( ! ok)
+	{
+		std::cerr << "can't read " << mbtiles_filename << std::endl;
+		return 1;
+	}
+
+	return Extractor(archive, directory).run(jobs ? jobs : 1);
+}
+
 struct options
 {
 	bool compute_levels = false;
+	bool watch = false;
+	bool streaming = false;
+	char *shm_cache = nullptr;
+	unsigned shm_cache_size = 0;
+	unsigned sched_workers = 0;
+	char *sched_weights = nullptr;
+	char *bulk_uids = nullptr;
+	unsigned bulk_zoom = 0;
+	char *trace_file = nullptr;
+	unsigned trace_sample = 0;
 	char *log_level = nullptr;
 	char *log_params = nullptr;
 } options;
@@ -601,6 +2105,30 @@ static struct fuse_opt options_desc[] =
 	OPT_DEF("no_compute_levels",      compute_levels, 0),
 	OPT_DEF("--compute_levels=true",  compute_levels, 1),
 	OPT_DEF("--compute_levels=false", compute_levels, 0),
+	OPT_DEF("watch",                  watch, 1),
+	OPT_DEF("no_watch",               watch, 0),
+	OPT_DEF("--watch=true",           watch, 1),
+	OPT_DEF("--watch=false",          watch, 0),
+	OPT_DEF("stream",                 streaming, 1),
+	OPT_DEF("no_stream",              streaming, 0),
+	OPT_DEF("--stream=true",          streaming, 1),
+	OPT_DEF("--stream=false",         streaming, 0),
+	OPT_DEF("shm_cache=%s",           shm_cache, 0),
+	OPT_DEF("--shm_cache %s",         shm_cache, 0),
+	OPT_DEF("shm_cache_size=%u",      shm_cache_size, 0),
+	OPT_DEF("--shm_cache_size %u",    shm_cache_size, 0),
+	OPT_DEF("sched_workers=%u",       sched_workers, 0),
+	OPT_DEF("--sched_workers %u",     sched_workers, 0),
+	OPT_DEF("sched_weights=%s",       sched_weights, 0),
+	OPT_DEF("--sched_weights %s",     sched_weights, 0),
+	OPT_DEF("bulk_uids=%s",           bulk_uids, 0),
+	OPT_DEF("--bulk_uids %s",         bulk_uids, 0),
+	OPT_DEF("bulk_zoom=%u",           bulk_zoom, 0),
+	OPT_DEF("--bulk_zoom %u",         bulk_zoom, 0),
+	OPT_DEF("trace_file=%s",          trace_file, 0),
+	OPT_DEF("--trace_file %s",        trace_file, 0),
+	OPT_DEF("trace_sample=%u",        trace_sample, 0),
+	OPT_DEF("--trace_sample %u",      trace_sample, 0),
 	OPT_DEF("log_level=%s",           log_level, 0),
 	OPT_DEF("--log_level %s",         log_level, 0),
 	OPT_DEF("log_params=%s",          log_params, 0),
@@ -616,13 +2144,36 @@ static struct fuse_opt options_desc[] =
 static void use(const char *prog_name)
 {
 	std::cerr << "use: " << prog_name << " [options] <mount_point> <mbtiles>" << std::endl;
+	std::cerr << "  or: " << prog_name << " extract [-j N] <directory> <mbtiles>" << std::endl;
 	std::cerr <<
 		"fuse_mbtiles options:\n"
 		"    -o compute_levels     - compute the minzoom/maxzoom values from the 'tiles' table\n"
 		"    -o no_compute_levels  - use the minzoom/maxzoom values from the 'metadata' table (default)\n"
+		"    -o watch              - reload the mbtiles file when it is republished\n"
+		"    -o no_watch           - reload the mbtiles file only on SIGUSR1 (default)\n"
+		"    -o stream             - stream pbf tiles with direct_io, the file size is the compressed size\n"
+		"    -o no_stream          - inflate pbf tiles as a whole (default)\n"
+		"    -o shm_cache=STRING   - name of the shared memory tile cache (default none)\n"
+		"    -o shm_cache_size=N   - size of the shared memory tile cache in MB (default 256)\n"
+		"    -o sched_workers=N    - run the requests on N scheduled workers (default 0 - disabled)\n"
+		"    -o sched_weights=I:B  - shares of the interactive and bulk requests, 0 - strict priority (default 8:1)\n"
+		"    -o bulk_uids=U1:U2... - users whose requests are bulk requests\n"
+		"    -o bulk_zoom=N        - requests for zoom levels from N are bulk requests\n"
+		"    -o trace_file=STRING  - file where the request spans are dumped on SIGUSR2 and at exit (default none)\n"
+		"    -o trace_sample=N     - trace one request out of N (default 1)\n"
 		"    -o log_level=STRING   - must be OFF (default) | ERROR | WARNING | DEBUG | TRACE\n"
 		"    -o log_params=STRING\n"
 		"    --compute_levels=BOOL - same as 'compute_levels' or 'no_compute_levels'\n"
+		"    --watch=BOOL          - same as 'watch' or 'no_watch'\n"
+		"    --stream=BOOL         - same as 'stream' or 'no_stream'\n"
+		"    --shm_cache STRING    - same as '-o shm_cache=STRING'\n"
+		"    --shm_cache_size N    - same as '-o shm_cache_size=N'\n"
+		"    --sched_workers N     - same as '-o sched_workers=N'\n"
+		"    --sched_weights I:B   - same as '-o sched_weights=I:B'\n"
+		"    --bulk_uids U1:U2...  - same as '-o bulk_uids=U1:U2...'\n"
+		"    --bulk_zoom N         - same as '-o bulk_zoom=N'\n"
+		"    --trace_file STRING   - same as '-o trace_file=STRING'\n"
+		"    --trace_sample N      - same as '-o trace_sample=N'\n"
 		"    --log_level STRING    - same as '-o log_level=STRING'\n"
 		"    --log_params STRING   - same as '-o log_params=STRING'\n"
 	;
@@ -642,6 +2193,9 @@ static int opt_proc(void *data, const char *arg, int key, struct fuse_args *outa
 
 int main(int argc, char *argv[])
 {
+	if (argc > 1 && strcmp(argv[1], "extract") == 0)
+		return extract(argv[0], argc - 1, argv + 1);
+
 	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
 
 	memset(&options, 0, sizeof(struct options));
@@ -664,6 +2218,67 @@ int main(int argc, char *argv[])
 #endif
 
 	compute_levels = options.compute_levels || getenv("FUSE_MBTILES_COMPUTE_LEVELS");
+	watch = options.watch || getenv("FUSE_MBTILES_WATCH");
+	streaming = options.streaming || getenv("FUSE_MBTILES_STREAM");
+
+	sched_workers = options.sched_workers;
+	if (options.sched_weights &&
+		sscanf(options.sched_weights, "%u:%u", &sched_weights[Scheduler::CLASS_INTERACTIVE], &sched_weights[Scheduler::CLASS_BULK]) != 2)
+	{
+		std::cerr << "invalid sched_weights: " << options.sched_weights << std::endl;
+		return 1;
+	}
+	if (options.bulk_uids)
+	{
+		std::istringstream uids(options.bulk_uids);
+		std::string uid;
+		while (std::getline(uids, uid, ':'))
+		{
+			char* end = nullptr;
+			bulk_uids.push_back(strtoul(uid.c_str(), &end, 10));
+			if (uid.empty() || *end)
+			{
+				std::cerr << "invalid bulk_uids: " << options.bulk_uids << std::endl;
+				return 1;
+			}
+		}
+	}
+	bulk_zoom = options.bulk_zoom;
+
+	const char* traceFileStr = options.trace_file ? options.trace_file : getenv("FUSE_MBTILES_TRACE_FILE");
+	if (traceFileStr && *traceFileStr)
+	{
+		// the daemon changes its working directory to /
+		trace_file = traceFileStr;
+		char cwd[PATH_MAX];
+		if (trace_file[0] != '/' && getcwd(cwd, sizeof(cwd)))
+			trace_file = std::string(cwd) + '/' + trace_file;
+
+		const char* traceSampleStr = getenv("FUSE_MBTILES_TRACE_SAMPLE");
+		unsigned traceSample = options.trace_sample ? options.trace_sample :
+			traceSampleStr ? atoi(traceSampleStr) : 1;
+		Tracer::setSampleRate(traceSample ? traceSample : 1);
+	}
+
+	const char* shmCacheName = options.shm_cache ? options.shm_cache : getenv("FUSE_MBTILES_SHM_CACHE");
+	if (shmCacheName && *shmCacheName)
+	{
+		const char* shmCacheSizeStr = getenv("FUSE_MBTILES_SHM_CACHE_SIZE");
+		size_t shmCacheSize = options.shm_cache_size ? options.shm_cache_size :
+			shmCacheSizeStr ? atoi(shmCacheSizeStr) : 256;
+
+		std::string name = shmCacheName;
+		if (name[0] != '/')
+			name = '/' + name;
+
+		// mapped before fuse_main daemonizes: the mapping is inherited
+		shm_cache.reset(new ShmCache(name, shmCacheSize << 20));
+		if ( ! shm_cache->attached())
+		{
+			std::cerr << "can't attach shared memory cache " << name << std::endl;
+			return 1;
+		}
+	}
 
 	// last arg - mbtiles file name
 	--args.argc;
@@ -671,10 +2286,14 @@ int main(int argc, char *argv[])
 
 	fuse_operations mbtiles_oper{};
 	mbtiles_oper.init = mbtiles_init;
+	mbtiles_oper.destroy = mbtiles_destroy;
 	mbtiles_oper.getattr = mbtiles_getattr;
 	mbtiles_oper.readdir = mbtiles_readdir;
 	mbtiles_oper.open = mbtiles_open;
 	mbtiles_oper.read = mbtiles_read;
+	mbtiles_oper.release = mbtiles_release;
+	mbtiles_oper.getxattr = mbtiles_getxattr;
+	mbtiles_oper.listxattr = mbtiles_listxattr;
 	
 	ret = fuse_main(args.argc, args.argv, &mbtiles_oper, NULL);
 	fuse_opt_free_args(&args);
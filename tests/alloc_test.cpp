@@ -0,0 +1,211 @@
+// Checks that the getattr and read of a tile allocate no memory once the tile was read before:
+// the connection, its statements, the inflate state and the tile buffers are reused.
+//
+// SQLite itself still allocates through sqlite3_malloc while stepping a statement
+// (a cursor and the record of the tile, a few allocations per tile), so its allocations
+// are counted with SQLITE_CONFIG_MALLOC and reported, but not asserted.
+
+#define main fuse_mbtiles_main
+#include "../fuse-mbtiles.cpp"
+#undef main
+
+#include <new>
+#include <stdlib.h>
+
+
+static std::atomic<long> allocations{0};
+
+void* operator new(size_t size)
+{
+	++allocations;
+	void* p = malloc(size ? size : 1);
+	if ( ! p)
+		throw std::bad_alloc();
+	return p;
+}
+
+void operator delete(void* p) noexcept
+{
+	free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+	free(p);
+}
+
+static std::atomic<long> sqlite_allocations{0};
+static sqlite3_mem_methods sqlite_methods;
+
+static void* sqliteMalloc(int size)
+{
+	++sqlite_allocations;
+	return sqlite_methods.xMalloc(size);
+}
+
+static void* sqliteRealloc(void* p, int size)
+{
+	++sqlite_allocations;
+	return sqlite_methods.xRealloc(p, size);
+}
+
+static const int ZOOM_LEVEL = 2;
+
+static std::string gzip(const std::string& data)
+{
+	z_stream strm{};
+	deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY); // gzip header
+	std::string out(deflateBound(&strm, data.size()), '\0');
+	strm.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+	strm.avail_in = data.size();
+	strm.next_out = reinterpret_cast<Bytef*>(&out[0]);
+	strm.avail_out = out.size();
+	deflate(&strm, Z_FINISH);
+	out.resize(strm.total_out);
+	deflateEnd(&strm);
+	return out;
+}
+
+static bool createMBTiles(const std::string& filename)
+{
+	sqlite3* database = nullptr;
+	if (sqlite3_open(filename.c_str(), &database) != SQLITE_OK)
+		return false;
+
+	bool ok = sqlite3_exec(database,
+		"CREATE TABLE metadata (name text, value text);"
+		"CREATE TABLE tiles (zoom_level integer, tile_column integer, tile_row integer, tile_data blob);"
+		"INSERT INTO metadata VALUES ('minzoom', '2'), ('maxzoom', '2'), ('format', 'pbf');",
+		nullptr, nullptr, nullptr) == SQLITE_OK;
+
+	sqlite3_stmt* insert = nullptr;
+	ok = ok && sqlite3_prepare_v2(database, "INSERT INTO tiles VALUES (?, ?, ?, ?)", -1, &insert, nullptr) == SQLITE_OK;
+	for (int x = 0; ok && x < (1 << ZOOM_LEVEL); ++x)
+	{
+		for (int y = 0; ok && y < (1 << ZOOM_LEVEL); ++y)
+		{
+			// tiles of different sizes, some of them bigger than a read
+			std::string tile;
+			for (int i = 0; i < 1000 * (1 + x * 37 + y * 11); ++i)
+				tile += char('a' + (i * (x + 1) + y) % 26);
+			const std::string data = gzip(tile);
+
+			sqlite3_bind_int(insert, 1, ZOOM_LEVEL);
+			sqlite3_bind_int(insert, 2, x);
+			sqlite3_bind_int(insert, 3, y);
+			sqlite3_bind_blob(insert, 4, data.data(), data.size(), SQLITE_TRANSIENT);
+			ok = sqlite3_step(insert) == SQLITE_DONE;
+			sqlite3_reset(insert);
+		}
+	}
+	sqlite3_finalize(insert);
+
+	return sqlite3_close(database) == SQLITE_OK && ok;
+}
+
+// getattr and read of all the tiles, returns the number of allocations made by them
+static long readTiles(long& sqlite)
+{
+	long counted = 0;
+	sqlite = 0;
+
+	char buf[16384];
+	for (int x = 0; x < (1 << ZOOM_LEVEL); ++x)
+	{
+		for (int y = 0; y < (1 << ZOOM_LEVEL); ++y)
+		{
+			char path[64];
+			snprintf(path, sizeof(path), "/%i/%i/%i.pbf", ZOOM_LEVEL, x, y);
+
+			// the inner functions: the mbtiles_ wrappers ask FUSE for the context of the request
+			long before = allocations;
+			long sqlite_before = sqlite_allocations;
+			struct stat st;
+			if (getAttr(path, &st) != 0)
+			{
+				fprintf(stderr, "getattr %s failed\n", path);
+				exit(1);
+			}
+			counted += allocations - before;
+			sqlite += sqlite_allocations - sqlite_before;
+
+			struct fuse_file_info fi{};
+			if (mbtiles_open(path, &fi) != 0)
+			{
+				fprintf(stderr, "open %s failed\n", path);
+				exit(1);
+			}
+
+			before = allocations;
+			sqlite_before = sqlite_allocations;
+			off_t offset = 0;
+			int size;
+			while ((size = readFile(path, buf, sizeof(buf), offset, &fi)) > 0)
+				offset += size;
+			counted += allocations - before;
+			sqlite += sqlite_allocations - sqlite_before;
+
+			mbtiles_release(path, &fi);
+
+			if (size < 0 || offset != st.st_size)
+			{
+				fprintf(stderr, "read %s: %lli bytes instead of %lli\n", path,
+					static_cast<long long>(offset), static_cast<long long>(st.st_size));
+				exit(1);
+			}
+		}
+	}
+
+	return counted;
+}
+
+int main()
+{
+	sqlite3_config(SQLITE_CONFIG_GETMALLOC, &sqlite_methods);
+	sqlite3_mem_methods methods = sqlite_methods;
+	methods.xMalloc = sqliteMalloc;
+	methods.xRealloc = sqliteRealloc;
+	sqlite3_config(SQLITE_CONFIG_MALLOC, &methods);
+
+	char filename[] = "/tmp/fuse-mbtiles-alloc-test-XXXXXX";
+	const int fd = mkstemp(filename);
+	if (fd < 0)
+	{
+		perror("mkstemp");
+		return 1;
+	}
+	close(fd);
+
+	int ret = 1;
+	bool ok = false;
+	if (createMBTiles(filename))
+	{
+		mbtiles_filename = filename;
+		setCurrentArchive(loadArchive(mbtiles_filename, ok));
+	}
+
+	if (ok)
+	{
+		// the first pass opens the connection, prepares the statements and grows the buffers
+		long sqlite;
+		readTiles(sqlite);
+
+		ret = 0;
+		for (int pass = 0; pass < 3; ++pass)
+		{
+			const long counted = readTiles(sqlite);
+			printf("pass %i: %li allocations, %li sqlite3_malloc allocations\n", pass, counted, sqlite);
+			if (counted != 0)
+				ret = 1;
+		}
+	}
+	else
+	{
+		fprintf(stderr, "can't create %s\n", filename);
+	}
+
+	setCurrentArchive(nullptr);
+	unlink(filename);
+
+	return ret;
+}